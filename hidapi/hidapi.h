@@ -63,10 +63,13 @@ extern "C" {
 			/** Product string */
 			wchar_t *product_string;
 			/** Usage Page for this Device/Interface
-			    (Windows/Mac only). */
+			    (Windows/Mac, and Linux hidraw, where a device
+			    is listed once for each top-level collection).
+			    With libusb, it is the first one in the report
+			    descriptor, and 0 if that isn't known. */
 			unsigned short usage_page;
 			/** Usage for this Device/Interface
-			    (Windows/Mac only).*/
+			    (Windows/Mac, Linux hidraw, and libusb as above).*/
 			unsigned short usage;
 			/** The USB interface which this logical device
 			    represents. Valid on both Linux implementations
@@ -95,6 +98,58 @@ extern "C" {
 		*/
 		int HID_API_EXPORT HID_API_CALL hid_init(void);
 
+		/** Keep a cache of the devices which hid_enumerate() and
+		    hid_open() answer from, rather than scanning them on every
+		    call. The cache is kept up to date by listening for
+		    devices being added and removed. hidraw only. */
+		#define HID_INIT_ENUMERATION_CACHE 0x1
+
+		/** Enumerate by reading sysfs directly, rather than through
+		    libudev, which works without udevd. Device nodes are
+		    taken to be /dev/hidrawN. The enumeration cache
+		    still uses libudev, so this only applies without
+		    HID_INIT_ENUMERATION_CACHE. hidraw only. */
+		#define HID_INIT_SYSFS_ENUMERATION 0x2
+
+		/** Enumerate large numbers of devices on a small pool of
+		    threads. The records are returned in the same order as
+		    without it. This only applies without
+		    HID_INIT_ENUMERATION_CACHE. hidraw only.
+
+		    Experimental: when threads are used, and how many, hasn't
+		    been tuned on real hardware yet, and may change. */
+		#define HID_INIT_PARALLEL_ENUMERATION 0x4
+
+		/** Don't read the manufacturer and product strings, or the
+		    serial number unless the filter matches on one, for the
+		    records from hid_enumerate() and hid_enumerate_filtered().
+		    With libusb this means devices aren't opened to read them.
+		    Use hid_device_info_get_string() to read them when they're
+		    needed. hid_enumerate_flat() still reads them. */
+		#define HID_INIT_LAZY_STRINGS 0x8
+
+		/** Handle the transfers of all open devices on one thread,
+		    rather than starting a thread for each device which is
+		    opened. libusb only. */
+		#define HID_INIT_SHARED_EVENT_THREAD 0x10
+
+		/** @brief Initialize the HIDAPI library, with options.
+
+			This is hid_init(), with flags (HID_INIT_*) which enable
+			optional features. Calling it again enables more features;
+			features can't be disabled except by hid_exit(). Flags which
+			a back-end doesn't support are ignored.
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+			@param flags HID_INIT_* flags, or 0.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_init_ex(unsigned int flags);
+
 		/** @brief Finalize the HIDAPI library.
 
 			This function frees all of the static data associated with
@@ -131,6 +186,127 @@ extern "C" {
 		*/
 		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned short vendor_id, unsigned short product_id);
 
+		/** Bus types which hid_enumeration_filter_set_bus_type()
+		    accepts. */
+		enum hid_bus_type {
+			HID_API_BUS_UNKNOWN = 0,
+			HID_API_BUS_USB = 1,
+			HID_API_BUS_BLUETOOTH = 2,
+		};
+
+		struct hid_enumeration_filter_;
+		/** A set of conditions for hid_enumerate_filtered(). A device
+		    must match one of the IDs in the filter (if any were added)
+		    and every other condition which has been set. */
+		typedef struct hid_enumeration_filter_ hid_enumeration_filter;
+
+		/** @brief Create an empty enumeration filter.
+
+			An empty filter matches every device. Free it with
+			hid_enumeration_filter_free().
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+
+			@returns
+				This function returns a new filter, or NULL on error.
+		*/
+		hid_enumeration_filter HID_API_EXPORT * HID_API_CALL hid_enumeration_filter_new(void);
+
+		/** @brief Free an enumeration filter.
+
+			@ingroup API
+			@param filter A filter from hid_enumeration_filter_new(),
+				or NULL.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_enumeration_filter_free(hid_enumeration_filter *filter);
+
+		/** @brief Add a Vendor ID/Product ID pair to a filter.
+
+			Devices match if they match any of the pairs added. As with
+			hid_enumerate(), 0 for either ID matches any vendor or
+			product. Looking a device up is constant time, so large
+			sets of IDs are fine.
+
+			@ingroup API
+			@param filter The filter.
+			@param vendor_id The Vendor ID (VID), or 0.
+			@param product_id The Product ID (PID), or 0.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_enumeration_filter_add_id(hid_enumeration_filter *filter, unsigned short vendor_id, unsigned short product_id);
+
+		/** @brief Only match devices on one bus.
+
+			@ingroup API
+			@param filter The filter.
+			@param bus_type The bus, or HID_API_BUS_UNKNOWN for any
+				bus. libusb only finds USB devices.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_enumeration_filter_set_bus_type(hid_enumeration_filter *filter, enum hid_bus_type bus_type);
+
+		/** @brief Only match one USB interface.
+
+			@ingroup API
+			@param filter The filter.
+			@param interface_number The interface number, or -1 for
+				any interface.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_enumeration_filter_set_interface(hid_enumeration_filter *filter, int interface_number);
+
+		/** @brief Only match top-level collections of a usage.
+
+			The usage comes from the device's report descriptor. With
+			libusb it is read from sysfs on Linux while usbhid is
+			bound to the interface, or remembered from an earlier
+			enumeration or hid_open() of the same model; if HIDAPI
+			was built with INVASIVE_GET_USAGE, it is otherwise read
+			from the device. A device whose usage isn't known doesn't
+			match.
+
+			@ingroup API
+			@param filter The filter.
+			@param usage_page The Usage Page, or 0 for any.
+			@param usage The Usage within @p usage_page, or 0 for any.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_enumeration_filter_set_usage(hid_enumeration_filter *filter, unsigned short usage_page, unsigned short usage);
+
+		/** @brief Only match devices with a serial number.
+
+			@ingroup API
+			@param filter The filter.
+			@param serial_number The serial number, which is copied,
+				or NULL for any.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_enumeration_filter_set_serial_number(hid_enumeration_filter *filter, const wchar_t *serial_number);
+
+		/** @brief Enumerate the HID Devices which match a filter.
+
+			This is hid_enumerate(), but with a filter. The filter is
+			applied as early as possible: on hidraw, small sets of IDs
+			are matched by udev itself, and on libusb, devices are only
+			opened (to read their strings) once their descriptors
+			match.
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+			@param filter The filter.
+
+			@returns
+				This function returns a linked list as for
+				hid_enumerate(), or NULL if no devices match or in
+				the case of failure. Free it by calling
+				hid_free_enumeration().
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_filtered(const hid_enumeration_filter *filter);
+
 		/** @brief Free an enumeration Linked List
 
 		    This function frees a linked list created by hid_enumerate().
@@ -141,12 +317,144 @@ extern "C" {
 		*/
 		void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *devs);
 
+		/** @brief Enumerate the HID Devices which match a filter, into
+			one block of memory.
+
+			This is hid_enumerate_filtered(), but the records are
+			returned as an array, in one allocation along with their
+			strings. Strings which several records share (such as the
+			manufacturer and product of a composite device) are only
+			stored once. The records are also linked through @p next,
+			so the array can be used as a list.
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+			@param filter The filter.
+			@param num_devices Set to the number of records returned.
+
+			@returns
+				This function returns a pointer to the first of
+				@p num_devices records, or NULL if no devices
+				match or in the case of failure. Free it by calling
+				hid_free_flat_enumeration(), not
+				hid_free_enumeration().
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_flat(const hid_enumeration_filter *filter, size_t *num_devices);
+
+		/** @brief Free records from hid_enumerate_flat().
+
+			@ingroup API
+			@param devs The records returned by hid_enumerate_flat(),
+				or NULL.
+		*/
+		void  HID_API_EXPORT HID_API_CALL hid_free_flat_enumeration(struct hid_device_info *devs);
+
+		struct hid_enumeration_;
+		/** An enumeration in progress, see hid_enumerate_begin(). */
+		typedef struct hid_enumeration_ hid_enumeration;
+
+		/** The string fields of struct #hid_device_info, see
+		    hid_enumerate_get_string(). */
+		enum hid_string_type {
+			HID_STRING_MANUFACTURER,
+			HID_STRING_PRODUCT,
+			HID_STRING_SERIAL_NUMBER,
+		};
+
+		/** @brief Start enumerating the HID Devices which match a
+			filter, one at a time.
+
+			Unlike hid_enumerate(), records are only made as they are
+			asked for with hid_enumerate_next(), and their strings
+			only when they are asked for with
+			hid_enumerate_get_string(), so enumeration can stop at
+			the first match cheaply.
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+			@param filter The filter, or NULL to match every device.
+				It must not be changed or freed until
+				hid_enumerate_end().
+
+			@returns
+				This function returns a new enumeration, or NULL
+				on error. Free it with hid_enumerate_end().
+		*/
+		hid_enumeration HID_API_EXPORT * HID_API_CALL hid_enumerate_begin(const hid_enumeration_filter *filter);
+
+		/** @brief Get the next record of an enumeration.
+
+			The record's string fields are NULL until they are fetched
+			with hid_enumerate_get_string(), except that the serial
+			number is filled in if the filter has one. Its next field
+			is not meaningful.
+
+			@ingroup API
+			@param enumeration The enumeration.
+
+			@returns
+				This function returns the next record, which is
+				valid until the next call for @p enumeration, or
+				NULL when there are no more.
+		*/
+		const struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_next(hid_enumeration *enumeration);
+
+		/** @brief Get a string of the record last returned by
+			hid_enumerate_next().
+
+			The strings are read from the device the first time one of
+			them is asked for, and are also filled in in the record.
+
+			@ingroup API
+			@param enumeration The enumeration.
+			@param type Which string.
+
+			@returns
+				This function returns the string, which is valid
+				as long as the record, or NULL if the device
+				doesn't have it.
+		*/
+		const wchar_t HID_API_EXPORT * HID_API_CALL hid_enumerate_get_string(hid_enumeration *enumeration, enum hid_string_type type);
+
+		/** @brief Finish an enumeration.
+
+			@ingroup API
+			@param enumeration The enumeration, or NULL.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_enumerate_end(hid_enumeration *enumeration);
+
+		/** @brief Get a string of a record from hid_enumerate(),
+			reading it from the device if the record doesn't have it.
+
+			This is for records enumerated with HID_INIT_LAZY_STRINGS.
+			The string is kept in the record, and freed with it. It
+			mustn't be used on records from hid_enumerate_flat().
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+			@param info A record from hid_enumerate() or
+				hid_enumerate_filtered().
+			@param type Which of the strings to get.
+
+			@returns
+				This function returns the string, or NULL if the
+				device doesn't have it or it can't be read.
+		*/
+		const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_string(struct hid_device_info *info, enum hid_string_type type);
+
 		/** @brief Open a HID device using a Vendor ID (VID), Product ID
 			(PID) and optionally a serial number.
 
 			If @p serial_number is NULL, the first device with the
 			specified VID and PID is opened.
 
+			On Linux (hidraw and libusb), a device opened by serial
+			number is remembered, and opening it again doesn't scan
+			the devices unless it has been unplugged since.
+
 			@ingroup API
 			@param vendor_id The Vendor ID (VID) of the device to open.
 			@param product_id The Product ID (PID) of the device to open.
@@ -174,6 +482,101 @@ extern "C" {
 		*/
 		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path);
 
+		/** What to do with an Input report which arrives when the
+		    device's input queue is full, see hid_open_options. */
+		enum hid_overflow_policy {
+			/** Drop the oldest queued report to make room (the
+			    default). If every other report is lent out by
+			    hid_read_borrow(), the one which just arrived is
+			    dropped. */
+			HID_OVERFLOW_DROP_OLDEST,
+			/** Drop the report which just arrived. */
+			HID_OVERFLOW_DROP_NEWEST,
+			/** Stop reading from the device until a report is read
+			    from the queue. Reports back up in the kernel's
+			    buffer (hidraw) or on the device (libusb), and may
+			    be dropped there. */
+			HID_OVERFLOW_BLOCK,
+		};
+
+		/** Options for hid_open_path_ex(). Always initialize with
+		    hid_open_options_init(&options, sizeof(options)) first.
+		    Fields are only added at the end. @p size tells the
+		    library which ones the caller has, so that the rest
+		    get their default values. */
+		struct hid_open_options {
+			/** The size of the struct the caller was built with,
+			    set by hid_open_options_init(). */
+			size_t size;
+			/** The number of Input reports which are queued before
+			    @p overflow_policy applies. 0 selects the default,
+			    32. */
+			unsigned int input_queue_depth;
+			/** What to do when the queue is full. */
+			enum hid_overflow_policy overflow_policy;
+			/** hidraw only: read the device from a background
+			    thread into a preallocated queue, so that reports
+			    aren't lost when the application is slow to read.
+			    Without it, reports are queued only by the kernel,
+			    which holds 64 and silently drops the rest. The
+			    libusb implementation always reads in the
+			    background. */
+			int background_reader;
+			/** Memory to keep queued Input reports in, or NULL
+			    to have it allocated. It must stay valid until the
+			    device is closed. Each report takes a slot the size
+			    of the device's longest Input report, at most 4096
+			    bytes. On libusb, that's rounded up to whole
+			    packets of the endpoint, or is the packets of one
+			    microframe if the report descriptor can't be read,
+			    at most 16384 bytes. As
+			    many reports are queued as there are slots, less
+			    one for each of @p num_transfers on libusb, where
+			    the next reports are read into slots.
+			    @p input_queue_depth is ignored. */
+			unsigned char *report_memory;
+			/** The size of @p report_memory in bytes. */
+			size_t report_memory_size;
+			/** libusb only: the number of Interrupt IN transfers
+			    which are kept submitted, so that the endpoint
+			    isn't left without one while a report is handled.
+			    Reports are still returned in order. 0 selects
+			    the default, 4. */
+			unsigned int num_transfers;
+		};
+
+		/** @brief Set a hid_open_options to the default options.
+
+			Only the first @p size bytes of @p options are written.
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+			@param options The options to initialize.
+			@param size sizeof(struct hid_open_options).
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_open_options_init(struct hid_open_options *options, size_t size);
+
+		/** @brief Open a HID device by its path name, with options.
+
+			This is hid_open_path(), with control over how Input reports
+			are queued. hid_open_path() uses the default options.
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+			@param path The path name of the device to open
+			@param options Options set up with hid_open_options_init(),
+				or NULL for the defaults. Fields beyond
+				hid_open_options::size have their default values.
+
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure, or if @p options wasn't
+				initialized.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path_ex(const char *path, const struct hid_open_options *options);
+
 		/** @brief Write an Output report to a HID device.
 
 			The first byte of @p data[] must contain the Report ID. For
@@ -243,6 +646,155 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_read(hid_device *device, unsigned char *data, size_t length);
 
+		/** Information about an Input report, see hid_read_ex(). */
+		struct hid_report_info {
+			/** Time at which the report arrived, in nanoseconds
+			    on the CLOCK_MONOTONIC_RAW clock (CLOCK_MONOTONIC
+			    where that is not available). */
+			unsigned long long timestamp;
+		};
+
+		/** @brief Read an Input report and its arrival time.
+
+			This is hid_read_timeout(), but also returns information
+			about the report. On libusb the timestamp is taken when
+			the transfer completes. On hidraw it is taken when the
+			background reader (see hid_open_options) receives the report.
+			Without the background reader the timestamp is taken when the
+			report is read, since the kernel doesn't record when reports
+			arrive.
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data A buffer to put the read data into.
+			@param length The number of bytes to read. For devices with
+				multiple reports, make sure to read an extra byte for
+				the report number.
+			@param info Filled in with information about the report
+				if one is read. Can be NULL.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the actual number of bytes read and
+				-1 on error. If no packet was available to be read within
+				the timeout period, this function returns 0.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_ex(hid_device *device, unsigned char *data, size_t length, struct hid_report_info *info, int milliseconds);
+
+		/** @brief Read several Input reports from a HID device with timeout.
+
+			This function waits, as hid_read_timeout() does, for at
+			least one Input report to become available. It then
+			returns that report and every other report which is
+			already queued, up to @p max_reports, without waiting
+			again. This saves a wait and a system call per report
+			on high-rate devices.
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data An array of @p max_reports buffers to put the
+				reports into, one report per buffer.
+			@param lengths An array of @p max_reports lengths. On entry,
+				lengths[i] is the size of data[i]. On return, the
+				first n entries (n being the return value) contain
+				the number of bytes read into the matching buffer.
+			@param max_reports The number of entries in @p data and
+				@p lengths.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of reports read and
+				-1 on error. If no report was available to be read within
+				the timeout period, this function returns 0.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_many(hid_device *device, unsigned char **data, size_t *lengths, size_t max_reports, int milliseconds);
+
+		/** An Input report lent out by hid_read_borrow(). */
+		struct hid_report_lease {
+			/** The report, including the Report ID for numbered
+			    reports as with hid_read(). */
+			const unsigned char *data;
+			/** The length of the report in bytes. */
+			size_t length;
+			/** See hid_report_info::timestamp. */
+			unsigned long long timestamp;
+			/** For internal use. */
+			void *slot;
+		};
+
+		/** @brief Borrow the next Input report from the input queue.
+
+			Rather than copying the report as hid_read_timeout() does,
+			this lends out the queue's own storage for it. The report
+			stays valid until it's returned with hid_read_release(),
+			and counts toward the queue's depth until then, so
+			leases should be short. Leases may be returned in any
+			order, but not after the device has been closed.
+
+			On hidraw this needs the background reader (see
+			hid_open_options).
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param lease Filled in with the report.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the length of the report and
+				-1 on error. If no report was available to be read
+				within the timeout period, this function returns 0.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_borrow(hid_device *device, struct hid_report_lease *lease, int milliseconds);
+
+		/** @brief Return a report borrowed with hid_read_borrow().
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param lease The lease filled in by hid_read_borrow().
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_release(hid_device *device, struct hid_report_lease *lease);
+
+		/** Counters for a device's input queue, see hid_get_queue_stats(). */
+		struct hid_queue_stats {
+			/** Input reports received from the device since it was
+			    opened, including those which were dropped. */
+			unsigned long long reports_received;
+			/** Input reports dropped because the queue was full. */
+			unsigned long long reports_dropped;
+			/** Input reports currently waiting to be read. */
+			unsigned int reports_queued;
+			/** Input reports lent out by hid_read_borrow(). */
+			unsigned int reports_leased;
+			/** The size of the queue. */
+			unsigned int queue_depth;
+		};
+
+		/** @brief Get the counters for a device's input queue.
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param stats Filled in with the counters.
+
+			@returns
+				This function returns 0 on success and -1 on error,
+				or if the device has no input queue (hidraw without
+				hid_open_options::background_reader).
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_queue_stats(hid_device *device, struct hid_queue_stats *stats);
+
 		/** @brief Set the device handle to be non-blocking.
 
 			In non-blocking mode calls to hid_read() will return
@@ -383,6 +935,294 @@ extern "C" {
 		*/
 		HID_API_EXPORT const wchar_t* HID_API_CALL hid_error(hid_device *device);
 
+		/** @brief Get a file descriptor to wait on for Input reports.
+
+			The returned descriptor can be passed to poll(), select()
+			or epoll to find out when hid_read() will not block. It is
+			readable while an Input report is available or after the
+			device has been disconnected (in which case hid_read()
+			returns -1). Don't read from, write to or close it; it
+			belongs to the device and is closed by hid_close().
+
+			On hidraw this is the device node itself, or with the
+			background reader (see hid_open_options) an eventfd
+			which works like the libusb one. On libusb it is
+			an eventfd (a pipe on systems without eventfd) signalled
+			by the read thread when the queue of Input reports goes
+			from empty to non-empty, and cleared when it is drained.
+
+			Only implemented on Linux (hidraw and libusb) and on the
+			libusb back-end on other systems.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns a file descriptor on success
+				and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_pollable_fd(hid_device *device);
+
+		struct hid_device_set_;
+		typedef struct hid_device_set_ hid_device_set; /**< opaque set of devices to wait on */
+
+		/** @brief Create an empty device set.
+
+			A device set lets one thread wait for Input reports from
+			many devices at once, see hid_wait_set(). Devices may be
+			added and removed from any thread.
+
+			Only implemented on Linux (hidraw and libusb).
+
+			@ingroup API
+
+			@returns
+				This function returns a pointer to a #hid_device_set
+				object on success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device_set * HID_API_CALL hid_device_set_new(void);
+
+		/** @brief Destroy a device set.
+
+			The devices which are still in the set are not closed.
+
+			@ingroup API
+			@param set A set returned from hid_device_set_new().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_device_set_free(hid_device_set *set);
+
+		/** @brief Add a device to a set.
+
+			A device can be in only one set at a time. hid_close()
+			removes the device from its set.
+
+			@ingroup API
+			@param set A set returned from hid_device_set_new().
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_device_set_add(hid_device_set *set, hid_device *device);
+
+		/** @brief Remove a device from its set.
+
+			@ingroup API
+			@param device A device previously passed to
+				hid_device_set_add().
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_device_set_remove(hid_device *device);
+
+		/** @brief Wait for devices in a set to have Input reports.
+
+			Returns the devices in @p set on which the next call to
+			hid_read() will not block, either because an Input report
+			is queued or because the device has been disconnected (in
+			which case hid_read() returns -1). The cost of a call
+			depends on the number of ready devices, not on the size of
+			the set.
+
+			A device must not be closed while another thread is
+			waiting on its set.
+
+			@ingroup API
+			@param set A set returned from hid_device_set_new().
+			@param ready An array to put the ready devices into.
+			@param max_ready The number of entries in @p ready.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of ready devices
+				and -1 on error. If no device became ready within
+				the timeout period, this function returns 0.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_wait_set(hid_device_set *set, hid_device **ready, size_t max_ready, int milliseconds);
+
+		struct hid_uring_;
+		typedef struct hid_uring_ hid_uring; /**< opaque io_uring engine */
+
+		/** Operation reported by a #hid_uring_completion. */
+		enum hid_uring_op {
+			/** An Input report was received. */
+			HID_URING_INPUT_REPORT,
+			/** A hid_uring_write() finished. */
+			HID_URING_WRITE,
+			/** A hid_uring_send_feature_report() finished. */
+			HID_URING_SEND_FEATURE_REPORT,
+			/** A hid_uring_get_feature_report() finished. */
+			HID_URING_GET_FEATURE_REPORT
+		};
+
+		/** Completion returned by hid_uring_wait(). */
+		struct hid_uring_completion {
+			/** Device the operation was performed on */
+			hid_device *device;
+			/** What completed */
+			enum hid_uring_op op;
+			/** Number of bytes transferred, or -1 on error. An
+			    Input report completion with a result of -1 means
+			    that the device was disconnected; no more reports
+			    will be received from it. */
+			int result;
+			/** The report data (#HID_URING_INPUT_REPORT only). It
+			    points into memory owned by the ring and is valid
+			    until the next call to hid_uring_wait(). */
+			const unsigned char *data;
+			/** The user_data given when the operation was
+			    submitted (NULL for Input reports). */
+			void *user_data;
+			/** Time at which the completion was reaped, on the
+			    same clock as hid_report_info::timestamp. */
+			unsigned long long timestamp;
+		};
+
+		/** @brief Create an io_uring engine for servicing many devices.
+
+			The engine keeps a read armed on every device added to it,
+			with the reports landing in a ring of buffers shared by all
+			of the devices. Writes and feature reports are queued and
+			submitted together the next time hid_uring_wait() is
+			called. One thread can then service a large number of
+			devices with a single system call per batch.
+
+			A ring must only be used from one thread at a time.
+
+			Only available on Linux (hidraw) when HIDAPI was built with
+			io_uring support (--enable-io-uring), and only on kernels
+			which support provided buffer rings (5.19 or later).
+
+			@ingroup API
+			@param queue_depth The number of submission queue entries
+				and of report buffers. Rounded up to a power of
+				two.
+
+			@returns
+				This function returns a pointer to a #hid_uring
+				object on success or NULL on failure or if io_uring
+				is not available.
+		*/
+		HID_API_EXPORT hid_uring * HID_API_CALL hid_uring_new(unsigned int queue_depth);
+
+		/** @brief Destroy an io_uring engine.
+
+			Any devices still in the ring are removed from it. The
+			devices themselves are not closed.
+
+			@ingroup API
+			@param ring A ring returned from hid_uring_new().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_uring_free(hid_uring *ring);
+
+		/** @brief Start receiving a device's Input reports through a ring.
+
+			Once a device has been added, its Input reports are
+			returned by hid_uring_wait() and must not be read with
+			hid_read() and friends. A device can be in only one ring.
+			hid_close() removes the device from its ring. Devices
+			opened with the background reader (see hid_open_options)
+			can't be added.
+
+			@ingroup API
+			@param ring A ring returned from hid_uring_new().
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_uring_add_device(hid_uring *ring, hid_device *device);
+
+		/** @brief Stop receiving a device's Input reports through its ring.
+
+			Operations which are still in flight for the device
+			complete without being reported.
+
+			@ingroup API
+			@param device A device previously passed to
+				hid_uring_add_device().
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_uring_remove_device(hid_device *device);
+
+		/** @brief Queue an Output report write on a ring.
+
+			See hid_write() for the format of @p data. The buffer
+			must remain valid until the matching completion is
+			returned by hid_uring_wait().
+
+			@ingroup API
+			@param device A device added to a ring with
+				hid_uring_add_device().
+			@param data The data to send, including the report number as
+				the first byte.
+			@param length The length in bytes of the data to send.
+			@param user_data Passed back in the completion.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_uring_write(hid_device *device, const unsigned char *data, size_t length, void *user_data);
+
+		/** @brief Queue a Feature report send on a ring.
+
+			See hid_send_feature_report() for the format of @p data.
+			hidraw has no asynchronous interface for feature reports,
+			so the transfer itself happens during this call; only its
+			completion is delivered through hid_uring_wait().
+
+			@ingroup API
+			@param device A device added to a ring with
+				hid_uring_add_device().
+			@param data The data to send, including the report number as
+				the first byte.
+			@param length The length in bytes of the data to send.
+			@param user_data Passed back in the completion.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_uring_send_feature_report(hid_device *device, const unsigned char *data, size_t length, void *user_data);
+
+		/** @brief Queue a Feature report read on a ring.
+
+			See hid_get_feature_report() for the format of @p data.
+			As with hid_uring_send_feature_report(), the transfer
+			happens during this call and its completion is delivered
+			through hid_uring_wait().
+
+			@ingroup API
+			@param device A device added to a ring with
+				hid_uring_add_device().
+			@param data A buffer to put the read data into, including
+				the Report ID.
+			@param length The size of @p data.
+			@param user_data Passed back in the completion.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_uring_get_feature_report(hid_device *device, unsigned char *data, size_t length, void *user_data);
+
+		/** @brief Submit queued operations and wait for completions.
+
+			@ingroup API
+			@param ring A ring returned from hid_uring_new().
+			@param completions An array to put the completions into.
+			@param max_completions The number of entries in
+				@p completions.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of completions
+				returned and -1 on error. If nothing completed
+				within the timeout period, this function returns 0.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_uring_wait(hid_uring *ring, struct hid_uring_completion *completions, size_t max_completions, int milliseconds);
+
 #ifdef __cplusplus
 }
 #endif
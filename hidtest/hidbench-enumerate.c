@@ -0,0 +1,285 @@
+/*******************************************************
+ HIDAPI enumeration benchmark (hidraw)
+
+ Times hid_enumerate() with the libudev engine and the sysfs one
+ (HID_INIT_SYSFS_ENUMERATION), each with and without
+ HID_INIT_PARALLEL_ENUMERATION. It runs on the devices which are
+ there, plus virtual devices it creates through uhid: for each count
+ in the -n list, devices are added until there are that many, and
+ every engine is timed.
+
+ Usage: hidbench-enumerate [-n devices[,devices...]] [-r runs]
+
+ For example, to see where the parallel enumeration starts to pay off,
+ and how it scales:
+
+   hidbench-enumerate -n 0,16,32,64,128,250,500,1000
+
+ The number of threads follows the CPUs the process may run on, so run
+ it under taskset (taskset -c 0-3 ...) to compare pool sizes.
+
+ Creating devices needs write access to /dev/uhid (usually root). They
+ are made Bluetooth devices, since hidapi leaves out USB-bus devices
+ without a USB parent, and they're removed when it exits.
+
+ This contents of this file may be used by anyone
+ for any reason without any conditions and may be
+ used as a starting point for your own applications
+ which use HIDAPI.
+********************************************************/
+
+#define _GNU_SOURCE /* For sched_getaffinity() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <linux/uhid.h>
+#include "hidapi.h"
+
+/* The virtual devices' IDs (pid.codes' test VID:PID) */
+#define BENCH_VENDOR_ID 0x1209
+#define BENCH_PRODUCT_ID 0x0001
+#define BUS_BLUETOOTH 0x05
+
+#define MAX_DEVICE_COUNTS 32
+
+/* One vendor-defined collection, with an 8 byte Input report */
+static const unsigned char report_descriptor[] = {
+	0x06, 0x00, 0xff,	/* Usage Page (Vendor Defined 0xFF00) */
+	0x09, 0x01,		/* Usage (0x01) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/*   Logical Maximum (255) */
+	0x75, 0x08,		/*   Report Size (8) */
+	0x95, 0x08,		/*   Report Count (8) */
+	0x09, 0x01,		/*   Usage (0x01) */
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */
+	0xc0,			/* End Collection */
+};
+
+static int *uhid_fds;
+static int num_uhid_fds;
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Create a virtual device. Returns -1 on failure. */
+static int create_uhid_device(int index)
+{
+	struct uhid_event ev;
+	int fd;
+
+	fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		perror("/dev/uhid");
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *) ev.u.create2.name, sizeof(ev.u.create2.name), "hidbench %d", index);
+	snprintf((char *) ev.u.create2.uniq, sizeof(ev.u.create2.uniq), "HB%05d", index);
+	ev.u.create2.rd_size = sizeof(report_descriptor);
+	ev.u.create2.bus = BUS_BLUETOOTH;
+	ev.u.create2.vendor = BENCH_VENDOR_ID;
+	ev.u.create2.product = BENCH_PRODUCT_ID;
+	memcpy(ev.u.create2.rd_data, report_descriptor, sizeof(report_descriptor));
+	if (write(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+		perror("UHID_CREATE2");
+		close(fd);
+		return -1;
+	}
+
+	uhid_fds[num_uhid_fds++] = fd;
+	return 0;
+}
+
+static void destroy_uhid_devices(void)
+{
+	int i;
+
+	for (i = 0; i < num_uhid_fds; i++)
+		close(uhid_fds[i]);
+	num_uhid_fds = 0;
+}
+
+/* Create virtual devices until there are num_devices, and wait for
+   their hidraw nodes. uhid_fds must have room for them. Returns -1 on
+   failure. */
+static int create_uhid_devices(int num_devices)
+{
+	double deadline;
+
+	while (num_uhid_fds < num_devices) {
+		if (create_uhid_device(num_uhid_fds) < 0)
+			return -1;
+	}
+
+	deadline = now_ms() + 30000;
+	while (now_ms() < deadline) {
+		struct hid_device_info *devs = hid_enumerate(BENCH_VENDOR_ID, BENCH_PRODUCT_ID);
+		size_t n = 0;
+		struct hid_device_info *d;
+
+		for (d = devs; d; d = d->next)
+			n++;
+		hid_free_enumeration(devs);
+		if (n >= (size_t) num_devices)
+			return 0;
+		usleep(100000);
+	}
+
+	fprintf(stderr, "The hidraw nodes didn't all appear\n");
+	return -1;
+}
+
+/* The number of CPUs the process may run on, as hidapi counts them */
+static long get_num_cpus(void)
+{
+	cpu_set_t cpus;
+
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+		return CPU_COUNT(&cpus);
+	return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/* Time runs calls of hid_enumerate(), after hid_init_ex(flags), and
+   print the median and fastest. */
+static void time_enumeration(const char *name, unsigned int flags, int runs)
+{
+	double *times;
+	size_t num_records = 0;
+	int i;
+
+	times = malloc(runs * sizeof(double));
+	if (!times)
+		return;
+
+	hid_exit();
+	hid_init_ex(flags);
+
+	/* Once first, so that sysfs and the udev database are cached */
+	hid_free_enumeration(hid_enumerate(0, 0));
+
+	for (i = 0; i < runs; i++) {
+		struct hid_device_info *devs, *d;
+		double start = now_ms();
+
+		devs = hid_enumerate(0, 0);
+		times[i] = now_ms() - start;
+
+		num_records = 0;
+		for (d = devs; d; d = d->next)
+			num_records++;
+		hid_free_enumeration(devs);
+	}
+	hid_exit();
+
+	qsort(times, runs, sizeof(double), compare_double);
+	printf("%-16s records %6lu  median %9.3f ms  min %9.3f ms\n",
+	       name, (unsigned long) num_records, times[runs / 2], times[0]);
+	free(times);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n devices[,devices...]] [-r runs]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	int device_counts[MAX_DEVICE_COUNTS] = { 0 };
+	int num_counts = 1;
+	int max_devices = 0;
+	int runs = 20;
+	int res = 0;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		char *p;
+
+		switch (opt) {
+		case 'n':
+			num_counts = 0;
+			p = optarg;
+			while (*p && num_counts < MAX_DEVICE_COUNTS) {
+				device_counts[num_counts] = strtol(p, &p, 10);
+				if (device_counts[num_counts] < 0 ||
+				    (num_counts > 0 && device_counts[num_counts] < device_counts[num_counts-1]) ||
+				    (*p && *p != ',')) {
+					fprintf(stderr, "Bad device counts, they must be increasing: %s\n", optarg);
+					return 1;
+				}
+				num_counts++;
+				if (*p == ',')
+					p++;
+			}
+			if (num_counts == 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (runs < 1)
+		runs = 1;
+
+	max_devices = device_counts[num_counts-1];
+	if (max_devices > 0) {
+		struct rlimit rl;
+
+		/* One fd per device */
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rl);
+		}
+		uhid_fds = calloc(max_devices, sizeof(int));
+		if (!uhid_fds)
+			return 1;
+	}
+
+	printf("%ld CPUs, %d runs\n", get_num_cpus(), runs);
+	for (i = 0; i < num_counts; i++) {
+		/* time_enumeration() leaves hidapi exited */
+		if (hid_init() || create_uhid_devices(device_counts[i]) < 0) {
+			res = 1;
+			break;
+		}
+
+		printf("\n%d virtual devices\n", device_counts[i]);
+		time_enumeration("libudev", 0, runs);
+		time_enumeration("libudev+parallel", HID_INIT_PARALLEL_ENUMERATION, runs);
+		time_enumeration("sysfs", HID_INIT_SYSFS_ENUMERATION, runs);
+		time_enumeration("sysfs+parallel", HID_INIT_SYSFS_ENUMERATION | HID_INIT_PARALLEL_ENUMERATION, runs);
+	}
+
+	destroy_uhid_devices();
+	free(uhid_fds);
+	hid_exit();
+
+	return res;
+}
@@ -0,0 +1,150 @@
+/*******************************************************
+ HIDAPI read latency benchmark
+
+ Measures how long an Input report takes to reach a reader which is
+ blocked in hid_read_ex(): from the report's timestamp (when the
+ backend received it) to when hid_read_ex() returns.
+
+ Usage: hidbench-read VID:PID [reports]
+
+ The device has to send Input reports by itself, such as a mouse which
+ is being moved, or a test device streaming reports. Run this on an
+ otherwise idle machine.
+
+ This contents of this file may be used by anyone
+ for any reason without any conditions and may be
+ used as a starting point for your own applications
+ which use HIDAPI.
+********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "hidapi.h"
+
+#define WARMUP_REPORTS 10
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	/* The clock which the report timestamps use */
+#ifdef CLOCK_MONOTONIC_RAW
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) != 0)
+#endif
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const unsigned long long *sorted, size_t n, double p)
+{
+	return sorted[(size_t) (p * (n - 1))] / 1000.0;
+}
+
+/* Read num_reports reports, and print their latencies. Returns -1 if
+   the device couldn't be read. */
+static int run(const char *path, size_t num_reports)
+{
+	struct hid_open_options options;
+	struct hid_report_info info;
+	unsigned long long *latencies;
+	unsigned char buf[4096];
+	hid_device *handle;
+	size_t n = 0;
+	int res = 0;
+	int i;
+
+	hid_open_options_init(&options, sizeof(options));
+	options.background_reader = 1; /* For timestamps on hidraw */
+	handle = hid_open_path_ex(path, &options);
+	if (!handle) {
+		fprintf(stderr, "Can't open %s\n", path);
+		return -1;
+	}
+
+	latencies = malloc(num_reports * sizeof(unsigned long long));
+	if (!latencies) {
+		hid_close(handle);
+		return -1;
+	}
+
+	for (i = 0; i < WARMUP_REPORTS; i++) {
+		if (hid_read_ex(handle, buf, sizeof(buf), &info, 5000) <= 0)
+			break;
+	}
+
+	while (n < num_reports) {
+		unsigned long long t;
+
+		res = hid_read_ex(handle, buf, sizeof(buf), &info, 5000);
+		t = now_ns();
+		if (res <= 0) {
+			fprintf(stderr, "No report within 5 s (%d)\n", res);
+			break;
+		}
+		latencies[n++] = (t > info.timestamp)? t - info.timestamp: 0;
+	}
+	hid_close(handle);
+
+	if (n > 0) {
+		qsort(latencies, n, sizeof(unsigned long long), compare_ull);
+		printf("reports %6lu  p50 %8.1f us  p90 %8.1f us  p99 %8.1f us  max %8.1f us\n",
+		       (unsigned long) n,
+		       percentile_us(latencies, n, 0.50),
+		       percentile_us(latencies, n, 0.90),
+		       percentile_us(latencies, n, 0.99),
+		       latencies[n-1] / 1000.0);
+	}
+	free(latencies);
+
+	return (n == num_reports)? 0: -1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct hid_device_info *devs;
+	unsigned int vendor_id, product_id;
+	size_t num_reports = 5000;
+	char *path;
+	int res;
+
+	if (argc < 2 || sscanf(argv[1], "%x:%x", &vendor_id, &product_id) != 2) {
+		fprintf(stderr, "Usage: %s VID:PID [reports]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		num_reports = strtoul(argv[2], NULL, 0);
+	if (num_reports == 0)
+		num_reports = 1;
+
+	if (hid_init())
+		return 1;
+
+	devs = hid_enumerate(vendor_id, product_id);
+	if (!devs) {
+		fprintf(stderr, "No device %04x:%04x\n", vendor_id, product_id);
+		hid_exit();
+		return 1;
+	}
+	path = strdup(devs->path);
+	hid_free_enumeration(devs);
+
+	printf("%s, %ld CPUs\n", path, sysconf(_SC_NPROCESSORS_ONLN));
+	res = run(path, num_reports);
+
+	free(path);
+	hid_exit();
+
+	return res? 1: 0;
+}
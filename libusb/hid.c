@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <locale.h>
 #include <errno.h>
@@ -41,7 +42,12 @@
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <wchar.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <dirent.h>
+#endif
 
 /* GNU / LibUSB */
 #include <libusb.h>
@@ -127,20 +133,59 @@ extern "C" {
 #endif
 
 /* Uncomment to enable the retrieval of Usage and Usage Page in
-hid_enumerate(). Warning, on platforms different from FreeBSD
-this is very invasive as it requires the detach
+hid_enumerate() when they can't be found without opening the device (from
+sysfs on Linux, or from the usage cache). Warning, on platforms different
+from FreeBSD this is very invasive as it requires the detach
 and re-attach of the kernel driver. See comments inside hid_enumerate().
 libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
+/* Default depth of the input queue, see hid_open_options. */
+#define DEFAULT_INPUT_QUEUE_DEPTH 32
+
+/* Default number of Interrupt IN transfers, see hid_open_options. */
+#define DEFAULT_NUM_TRANSFERS 4
+
+/* The longest Interrupt IN transfer, HID_MAX_BUFFER_SIZE in Linux. */
+#define MAX_INPUT_TRANSFER_SIZE 16384
+
+/* The clock which condition variables are timed against, see
+   init_timed_condition(). CLOCK_MONOTONIC isn't thrown off when the time
+   is set, but not every platform can time a condition against it. */
+#if defined(CLOCK_MONOTONIC) && !defined(__APPLE__)
+#define CONDITION_CLOCK CLOCK_MONOTONIC
+#else
+#define CONDITION_CLOCK CLOCK_REALTIME
+#endif
+
+/* An input report. They are all allocated when the device is opened, and
+   each one is free, being read into by the transfer, queued, or lent out
+   by hid_read_borrow(). next links the free list. */
 struct input_report {
 	uint8_t *data;
 	size_t len;
+	unsigned long long timestamp; /* See get_timestamp() */
 	struct input_report *next;
 };
 
+/* An Interrupt IN transfer, and the input report which it reads into.
+   done is set when it completes, until its turn comes to be handled, see
+   read_callback(). */
+struct read_transfer {
+	hid_device *dev;
+	struct libusb_transfer *transfer;
+	struct input_report *report;
+	int done;
+};
+
+
+/* A string which has been read from a device, by its index */
+struct cached_string {
+	int index;
+	wchar_t *string;
+	struct cached_string *next;
+};
 
 struct hid_device_ {
 	/* Handle to the actual device. */
@@ -150,6 +195,11 @@ struct hid_device_ {
 	int input_endpoint;
 	int output_endpoint;
 	int input_ep_max_packet_size;
+	int input_ep_transactions; /* Per (micro)frame, 2 or 3 for high-bandwidth endpoints */
+
+	/* The longest Input report, from the report descriptor, or 0 if it
+	   isn't known */
+	size_t max_input_report_size;
 
 	/* The interface number of the HID */
 	int interface;
@@ -159,50 +209,271 @@ struct hid_device_ {
 	int product_index;
 	int serial_index;
 
+	/* Strings which have been read, and the language they're read in
+	   once it's known, see get_cached_string() */
+	pthread_mutex_t strings_mutex;
+	struct cached_string *strings;
+	int have_language;
+	uint16_t language;
+
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 
 	/* Read thread objects */
 	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	pthread_mutex_t mutex; /* Protects the input reports */
 	pthread_cond_t condition;
+	pthread_cond_t space_condition; /* Signaled when a transfer is resubmitted */
 	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	int shutdown_thread;
-	int cancelled;
-	struct libusb_transfer *transfer;
+	int cancelled; /* No transfers are submitted, after shutdown_thread */
+	int has_read_thread; /* Otherwise the shared event thread is used */
+
+	/* Interrupt IN transfers, a ring which is submitted in turn so that
+	   the endpoint always has one pending. next_transfer is the next to
+	   complete. The num_held_transfers before it aren't resubmitted, see
+	   HID_OVERFLOW_BLOCK. */
+	struct read_transfer *transfers;
+	unsigned int num_transfers;
+	unsigned int next_transfer;
+	unsigned int num_held_transfers;
+	unsigned int num_submitted_transfers;
+
+	/* Input reports, see struct input_report. report_memory is the
+	   data for all of them, if it was allocated here. */
+	struct input_report *report_pool;
+	unsigned char *report_memory;
+	size_t report_size;
+	struct input_report *free_reports;
+	unsigned int num_leased_reports;
+
+	/* Queue of received input reports, a ring of input_reports_mask + 1
+	   slots (a power of two, with room for every report) starting at
+	   input_reports_head. */
+	struct input_report **input_reports;
+	unsigned int input_reports_mask;
+	unsigned int input_reports_head;
+	unsigned int num_input_reports;
+	unsigned int input_queue_depth;
+	int signal_readers; /* See read_callback() */
+	int running_callbacks;
+	enum hid_overflow_policy overflow_policy;
+	unsigned long long reports_received;
+	unsigned long long reports_dropped;
+
+	/* Readable while input_reports is non-empty or the device is gone,
+	   see hid_get_pollable_fd(). An eventfd where available, otherwise
+	   the read end of a pipe (with signal_fd the write end). */
+	int pollable_fd;
+	int signal_fd;
+
+	/* Membership of a hid_device_set. set is protected by mutex,
+	   set_prev/set_next and the ready list fields by set->mutex. */
+	hid_device_set *set;
+	hid_device *set_prev;
+	hid_device *set_next;
+	hid_device *ready_next;
+	int set_ready; /* On the set's ready list */
+};
 
-	/* List of received input reports. */
-	struct input_report *input_reports;
+struct hid_enumeration_filter_ {
+	/* Open-addressed hash set of the IDs, as (vendor_id << 16) | product_id.
+	   0 marks an empty slot, so adding 0:0 sets match_any_id instead. */
+	unsigned int *ids;
+	size_t ids_size; /* A power of two */
+	size_t num_ids;
+	int match_any_id;
+	enum hid_bus_type bus_type;
+	int interface_number;
+	unsigned short usage_page;
+	unsigned short usage;
+	wchar_t *serial_number;
+};
+
+/* Used for enumerations without a filter */
+static const hid_enumeration_filter match_all_filter = {
+	NULL, 0, 0, 0, HID_API_BUS_UNKNOWN, -1, 0, 0, NULL
+};
+
+/* See hid_enumerate_begin(). Walks the HID interfaces of the devices in
+   libusb's device list. */
+struct hid_enumeration_ {
+	const hid_enumeration_filter *filter;
+	libusb_device **devs;
+	ssize_t num_devs;
+	ssize_t next_dev;
+
+	/* The current device, and the next of its interfaces to look at */
+	libusb_device *dev;
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc;
+	int intf_index;
+	int alt_index;
+
+	/* The record last returned */
+	struct hid_device_info info;
+	int have_strings;
+};
+
+struct hid_device_set_ {
+	pthread_mutex_t mutex; /* Protects members and the ready list */
+	pthread_cond_t condition;
+	hid_device *members;
+
+	/* Devices which have received reports since they were last
+	   returned by hid_wait_set(). */
+	hid_device *ready_head;
+	hid_device *ready_tail;
 };
 
 static libusb_context *usb_context = NULL;
 
+/* Leave strings out of enumerations, see HID_INIT_LAZY_STRINGS */
+static int lazy_strings = 0;
+
+/* The thread which handles the events of every device opened with
+   HID_INIT_SHARED_EVENT_THREAD, instead of each having a read_thread().
+   It runs from the first such hid_open_path() until hid_exit(). */
+static int shared_event_thread = 0;
+static pthread_mutex_t event_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t event_thread;
+static int event_thread_running = 0;
+static int event_thread_stop = 0;
+
 uint16_t get_usb_code_for_current_locale(void);
-static int return_data(hid_device *dev, unsigned char *data, size_t length);
+static int return_data(hid_device *dev, unsigned char *data, size_t length, struct hid_report_info *info);
+static void read_callback(struct libusb_transfer *transfer);
+static void stop_event_thread(void);
+static void mark_ready(hid_device *dev);
+static void clear_open_index(void);
+
+/* Initialize a condition variable which is waited on with a timeout from
+   get_abs_timeout(). */
+static void init_timed_condition(pthread_cond_t *cond)
+{
+#if defined(CLOCK_MONOTONIC) && !defined(__APPLE__)
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CONDITION_CLOCK);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
 
 static hid_device *new_hid_device(void)
 {
 	hid_device *dev = calloc(1, sizeof(hid_device));
+	if (!dev)
+		return NULL;
 	dev->blocking = 1;
 
+#ifdef EFD_NONBLOCK
+	dev->pollable_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	dev->signal_fd = dev->pollable_fd;
+#else
+	{
+		int fds[2];
+		dev->pollable_fd = dev->signal_fd = -1;
+		if (pipe(fds) == 0) {
+			fcntl(fds[0], F_SETFL, O_NONBLOCK);
+			fcntl(fds[1], F_SETFL, O_NONBLOCK);
+			fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+			fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+			dev->pollable_fd = fds[0];
+			dev->signal_fd = fds[1];
+		}
+	}
+#endif
+
 	pthread_mutex_init(&dev->mutex, NULL);
-	pthread_cond_init(&dev->condition, NULL);
+	init_timed_condition(&dev->condition);
+	pthread_cond_init(&dev->space_condition, NULL);
 	pthread_barrier_init(&dev->barrier, NULL, 2);
+	pthread_mutex_init(&dev->strings_mutex, NULL);
 
 	return dev;
 }
 
 static void free_hid_device(hid_device *dev)
 {
+	unsigned int i;
+
+	/* Transfers and input reports, see alloc_input_reports() */
+	for (i = 0; i < dev->num_transfers; i++)
+		libusb_free_transfer(dev->transfers[i].transfer);
+	free(dev->transfers);
+	free(dev->input_reports);
+	free(dev->report_pool);
+	free(dev->report_memory);
+
+	/* Strings, see get_cached_string() */
+	while (dev->strings) {
+		struct cached_string *next = dev->strings->next;
+		free(dev->strings->string);
+		free(dev->strings);
+		dev->strings = next;
+	}
+	pthread_mutex_destroy(&dev->strings_mutex);
+
 	/* Clean up the thread objects */
 	pthread_barrier_destroy(&dev->barrier);
+	pthread_cond_destroy(&dev->space_condition);
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
+	if (dev->pollable_fd >= 0)
+		close(dev->pollable_fd);
+	if (dev->signal_fd >= 0 && dev->signal_fd != dev->pollable_fd)
+		close(dev->signal_fd);
+
 	/* Free the device itself */
 	free(dev);
 }
 
+/* Monotonic time in nanoseconds, used to timestamp input reports as
+   they arrive. */
+static unsigned long long get_timestamp(void)
+{
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Make pollable_fd readable. This should be called with dev->mutex
+   locked, when input_reports becomes non-empty or the device goes away. */
+static void set_pollable(hid_device *dev)
+{
+#ifdef EFD_NONBLOCK
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif
+	if (write(dev->signal_fd, &one, sizeof(one)) < 0)
+		LOG("Unable to signal the pollable fd: %d\n", errno);
+}
+
+/* Make pollable_fd unreadable. This should be called with dev->mutex
+   locked, when input_reports becomes empty. */
+static void clear_pollable(hid_device *dev)
+{
+#ifdef EFD_NONBLOCK
+	uint64_t count;
+	if (read(dev->pollable_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		LOG("Unable to clear the pollable fd: %d\n", errno);
+#else
+	char buf[64];
+	while (read(dev->pollable_fd, buf, sizeof(buf)) > 0)
+		;
+#endif
+}
+
 #if 0
 /*TODO: Implement this funciton on hidapi/libusb.. */
 static void register_error(hid_device *device, const char *op)
@@ -211,7 +482,6 @@ static void register_error(hid_device *device, const char *op)
 }
 #endif
 
-#ifdef INVASIVE_GET_USAGE
 /* Get bytes from a HID Report Descriptor.
    Only call with a num_bytes of 0, 1, 2, or 4. */
 static uint32_t get_bytes(uint8_t *rpt, size_t len, size_t num_bytes, size_t cur)
@@ -311,7 +581,102 @@ static int get_usage(uint8_t *report_descriptor, size_t size,
 
 	return -1; /* failure */
 }
-#endif /* INVASIVE_GET_USAGE */
+
+/* Get the length in bytes of the longest Input report described by
+   report_descriptor, including the Report ID for numbered reports, or 0
+   if there are no Input items. */
+static size_t get_max_input_report_size(uint8_t *report_descriptor, size_t size)
+{
+	/* Bits of Input items in each report, by Report ID. */
+	unsigned long bits[256];
+	/* Global items, with room for a few Push items */
+	struct {
+		unsigned long report_size;
+		unsigned long report_count;
+		unsigned int report_id;
+	} globals[8];
+	int depth = 0;
+	int numbered = 0;
+	unsigned long max_bits = 0;
+	size_t i = 0;
+	int j;
+
+	memset(bits, 0, sizeof(bits));
+	memset(&globals[0], 0, sizeof(globals[0]));
+
+	while (i < size) {
+		int key = report_descriptor[i];
+		int data_len;
+		unsigned long value = 0;
+
+		if ((key & 0xf0) == 0xf0) {
+			/* Long Item. None of them matter here. */
+			data_len = (i+1 < size)? report_descriptor[i+1]: 0;
+			i += data_len + 3;
+			continue;
+		}
+
+		/* Short Item */
+		data_len = key & 0x3;
+		if (data_len == 3)
+			data_len = 4;
+		if (i + data_len >= size)
+			break; /* malformed report */
+		for (j = 0; j < data_len; j++)
+			value |= (unsigned long) report_descriptor[i+1+j] << (8*j);
+
+		switch (key & 0xfc) {
+		case 0x74: /* Report Size */
+			globals[depth].report_size = value;
+			break;
+		case 0x94: /* Report Count */
+			globals[depth].report_count = value;
+			break;
+		case 0x84: /* Report ID */
+			globals[depth].report_id = value & 0xff;
+			numbered = 1;
+			break;
+		case 0xa4: /* Push */
+			if (depth + 1 < (int) (sizeof(globals) / sizeof(globals[0]))) {
+				globals[depth+1] = globals[depth];
+				depth++;
+			}
+			break;
+		case 0xb4: /* Pop */
+			if (depth > 0)
+				depth--;
+			break;
+		case 0x80: /* Input */
+			bits[globals[depth].report_id] +=
+				globals[depth].report_size * globals[depth].report_count;
+			if (bits[globals[depth].report_id] > max_bits)
+				max_bits = bits[globals[depth].report_id];
+			break;
+		}
+
+		i += data_len + 1;
+	}
+
+	if (max_bits == 0)
+		return 0;
+	return (max_bits + 7) / 8 + numbered;
+}
+
+/* What's used from the report descriptor of an interface. */
+struct report_descriptor_info {
+	unsigned short usage_page;
+	unsigned short usage;
+	size_t max_input_report_size; /* 0 if there are no Input items */
+};
+
+static void parse_report_descriptor(uint8_t *report_descriptor, size_t size, struct report_descriptor_info *info)
+{
+	if (get_usage(report_descriptor, size, &info->usage_page, &info->usage) < 0) {
+		info->usage_page = 0;
+		info->usage = 0;
+	}
+	info->max_input_report_size = get_max_input_report_size(report_descriptor, size);
+}
 
 #if defined(__FreeBSD__) && __FreeBSD__ < 10
 /* The libusb version included in FreeBSD < 10 doesn't have this function. In
@@ -335,59 +700,52 @@ static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
 #endif
 
 
-/* Get the first language the device says it reports. This comes from
-   USB string #0. */
-static uint16_t get_first_language(libusb_device_handle *dev)
-{
-	uint16_t buf[32];
-	int len;
+/* The USB language ID of the locale, which is found once, see
+   get_locale_language() */
+static pthread_once_t locale_language_once = PTHREAD_ONCE_INIT;
+static uint16_t locale_language = 0x0;
 
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			0x0, /* String ID */
-			0x0, /* Language */
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 4)
-		return 0x0;
+static void find_locale_language(void)
+{
+	locale_language = get_usb_code_for_current_locale();
+}
 
-	return buf[1]; /* First two bytes are len and descriptor type. */
+static uint16_t get_locale_language(void)
+{
+	pthread_once(&locale_language_once, find_locale_language);
+	return locale_language;
 }
 
-static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
+/* Choose the language to read a device's strings in, from its string #0
+   (the list of language IDs it supports): the locale's if it's
+   supported, or else the first. */
+static uint16_t choose_language(const unsigned char *data, int len)
 {
-	uint16_t buf[32];
-	int len;
+	uint16_t lang = get_locale_language();
 	int i;
 
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			0x0, /* String ID */
-			0x0, /* Language */
-			(unsigned char*)buf,
-			sizeof(buf));
 	if (len < 4)
 		return 0x0;
 
-
-	len /= 2; /* language IDs are two-bytes each. */
-	/* Start at index 1 because there are two bytes of protocol data. */
-	for (i = 1; i < len; i++) {
-		if (buf[i] == lang)
-			return 1;
+	/* Start at 2, after the length and descriptor type. */
+	for (i = 2; i + 1 < len; i += 2) {
+		if ((data[i] | (data[i+1] << 8)) == lang)
+			return lang;
 	}
 
-	return 0;
+	return data[2] | (data[3] << 8);
 }
 
+#ifndef __ANDROID__
+/* The converter used by usb_string_to_wchar_t(), which is opened once */
+static pthread_mutex_t converter_mutex = PTHREAD_MUTEX_INITIALIZER;
+static iconv_t converter = (iconv_t)-1;
+#endif
 
-/* This function returns a newly allocated wide string containing the USB
-   device string numbered by the index. The returned string must be freed
-   by using free(). */
-static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
+/* Convert a string descriptor of len bytes, as returned by
+   libusb_get_string_descriptor(), to a newly allocated wide string. */
+static wchar_t *usb_string_to_wchar_t(const unsigned char *buf, int len)
 {
-	char buf[512];
-	int len;
 	wchar_t *str = NULL;
 
 #ifndef __ANDROID__ /* we don't use iconv on Android */
@@ -405,19 +763,7 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	char *outptr;
 #endif
 
-	/* Determine which language to use. */
-	uint16_t lang;
-	lang = get_usb_code_for_current_locale();
-	if (!is_language_supported(dev, lang))
-		lang = get_first_language(dev);
-
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			idx,
-			lang,
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 0)
+	if (len < 2)
 		return NULL;
 
 #ifdef __ANDROID__
@@ -442,16 +788,24 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	/* buf does not need to be explicitly NULL-terminated because
 	   it is only passed into iconv() which does not need it. */
 
-	/* Initialize iconv. */
-	ic = iconv_open("WCHAR_T", "UTF-16LE");
-	if (ic == (iconv_t)-1) {
-		LOG("iconv_open() failed\n");
-		return NULL;
+	/* Initialize iconv, the first time, or reset it. */
+	pthread_mutex_lock(&converter_mutex);
+	if (converter == (iconv_t)-1) {
+		converter = iconv_open("WCHAR_T", "UTF-16LE");
+		if (converter == (iconv_t)-1) {
+			pthread_mutex_unlock(&converter_mutex);
+			LOG("iconv_open() failed\n");
+			return NULL;
+		}
+	}
+	else {
+		iconv(converter, NULL, NULL, NULL, NULL);
 	}
+	ic = converter;
 
 	/* Convert to native wchar_t (UTF-32 on glibc/BSD systems).
 	   Skip the first character (2-bytes). */
-	inptr = buf+2;
+	inptr = (char*) buf+2;
 	inbytes = len-2;
 	outptr = (char*) wbuf;
 	outbytes = sizeof(wbuf);
@@ -470,314 +824,2022 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	str = wcsdup(wbuf);
 
 err:
-	iconv_close(ic);
+	pthread_mutex_unlock(&converter_mutex);
 
 #endif
 
 	return str;
 }
 
-static char *make_path(libusb_device *dev, int interface_number)
+/* Get the language to read the device's strings in, see
+   choose_language(). This comes from USB string #0. */
+static uint16_t get_language(libusb_device_handle *dev)
 {
-	char str[64];
-	snprintf(str, sizeof(str), "%04x:%04x:%02x",
-		libusb_get_bus_number(dev),
-		libusb_get_device_address(dev),
-		interface_number);
-	str[sizeof(str)-1] = '\0';
+	unsigned char buf[256];
+	int len;
 
-	return strdup(str);
-}
+	len = libusb_get_string_descriptor(dev,
+			0x0, /* String ID */
+			0x0, /* Language */
+			buf,
+			sizeof(buf));
 
+	return choose_language(buf, len);
+}
 
-int HID_API_EXPORT hid_init(void)
+/* This function returns a newly allocated wide string containing the USB
+   device string numbered by the index, in language lang (see
+   get_language()). The returned string must be freed by using free(). */
+static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx, uint16_t lang)
 {
-	if (!usb_context) {
-		const char *locale;
-
-		/* Init Libusb */
-		if (libusb_init(&usb_context))
-			return -1;
+	unsigned char buf[512];
+	int len;
 
-		/* Set the locale if it's not set. */
-		locale = setlocale(LC_CTYPE, NULL);
-		if (!locale)
-			setlocale(LC_CTYPE, "");
-	}
+	/* Get the string from libusb. */
+	len = libusb_get_string_descriptor(dev,
+			idx,
+			lang,
+			buf,
+			sizeof(buf));
+	if (len < 0)
+		return NULL;
 
-	return 0;
+	return usb_string_to_wchar_t(buf, len);
 }
 
-int HID_API_EXPORT hid_exit(void)
+/* The number of strings in a record, see enum hid_string_type */
+#define NUM_DEVICE_STRINGS 3
+
+#ifdef __linux__
+/* Read a file in sysfs, which is NUL terminated without its trailing
+   newline. Returns its length, or -1. */
+static int read_sysfs_file(const char *path, char *buf, size_t size)
 {
-	if (usb_context) {
-		libusb_exit(usb_context);
-		usb_context = NULL;
-	}
+	int fd, len;
 
-	return 0;
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	while (len > 0 && buf[len-1] == '\n')
+		len--;
+	buf[len] = '\0';
+
+	return len;
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* Get the directory of dev in /sys/bus/usb/devices, which is named after
+   its bus number and port path, into path. Returns its length, or -1. */
+static int get_sysfs_device_path(libusb_device *dev, char *path, size_t size)
 {
-	libusb_device **devs;
-	libusb_device *dev;
-	libusb_device_handle *handle;
-	ssize_t num_devs;
-	int i = 0;
+	uint8_t ports[8];
+	char buf[32];
+	int num_ports, len, i;
 
-	struct hid_device_info *root = NULL; /* return object */
-	struct hid_device_info *cur_dev = NULL;
+	num_ports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	if (num_ports < 0)
+		return -1;
+	if (num_ports == 0) {
+		/* A root hub */
+		len = snprintf(path, size, "/sys/bus/usb/devices/usb%u",
+			libusb_get_bus_number(dev));
+	}
+	else {
+		len = snprintf(path, size, "/sys/bus/usb/devices/%u-%u",
+			libusb_get_bus_number(dev), ports[0]);
+		for (i = 1; i < num_ports; i++)
+			len += snprintf(path + len, size - len, ".%u", ports[i]);
+	}
 
-	if(hid_init() < 0)
-		return NULL;
+	/* Check that it's the same device, in case it's been replaced. */
+	snprintf(path + len, size - len, "/devnum");
+	if (read_sysfs_file(path, buf, sizeof(buf)) < 0 ||
+	    strtoul(buf, NULL, 10) != libusb_get_device_address(dev))
+		return -1;
+	path[len] = '\0';
 
-	num_devs = libusb_get_device_list(usb_context, &devs);
-	if (num_devs < 0)
-		return NULL;
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int j, k;
-		int interface_num = 0;
+	return len;
+}
 
-		int res = libusb_get_device_descriptor(dev, &desc);
-		unsigned short dev_vid = desc.idVendor;
-		unsigned short dev_pid = desc.idProduct;
+/* Get a string of dev which the kernel has already read from it, from
+   sysfs, as a newly allocated wide string, so that the device isn't
+   asked for it again. Returns NULL if the string isn't there. */
+static wchar_t *get_sysfs_usb_string(libusb_device *dev, enum hid_string_type type)
+{
+	static const char *const attributes[] = {
+		"manufacturer", /* HID_STRING_MANUFACTURER */
+		"product", /* HID_STRING_PRODUCT */
+		"serial", /* HID_STRING_SERIAL_NUMBER */
+	};
+	char path[128];
+	char buf[512];
+	int len;
+	size_t wlen;
+	wchar_t *str;
 
-		res = libusb_get_active_config_descriptor(dev, &conf_desc);
-		if (res < 0)
-			libusb_get_config_descriptor(dev, 0, &conf_desc);
-		if (conf_desc) {
-			for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-				const struct libusb_interface *intf = &conf_desc->interface[j];
-				for (k = 0; k < intf->num_altsetting; k++) {
-					const struct libusb_interface_descriptor *intf_desc;
-					intf_desc = &intf->altsetting[k];
-					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-						interface_num = intf_desc->bInterfaceNumber;
-
-						/* Check the VID/PID against the arguments */
-						if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
-						    (product_id == 0x0 || product_id == dev_pid)) {
-							struct hid_device_info *tmp;
-
-							/* VID/PID match. Create the record. */
-							tmp = calloc(1, sizeof(struct hid_device_info));
-							if (cur_dev) {
-								cur_dev->next = tmp;
-							}
-							else {
-								root = tmp;
-							}
-							cur_dev = tmp;
+	if (type < 0 || type >= NUM_DEVICE_STRINGS)
+		return NULL;
 
-							/* Fill out the record */
-							cur_dev->next = NULL;
-							cur_dev->path = make_path(dev, interface_num);
+	len = get_sysfs_device_path(dev, path, sizeof(path));
+	if (len < 0)
+		return NULL;
 
-							res = libusb_open(dev, &handle);
+	snprintf(path + len, sizeof(path) - len, "/%s", attributes[type]);
+	if (read_sysfs_file(path, buf, sizeof(buf)) < 0)
+		return NULL;
 
-							if (res >= 0) {
-								/* Serial Number */
-								if (desc.iSerialNumber > 0)
-									cur_dev->serial_number =
-										get_usb_string(handle, desc.iSerialNumber);
+	/* Convert the string from UTF-8. If the locale can't, the device is
+	   asked instead. */
+	wlen = mbstowcs(NULL, buf, 0);
+	if (wlen == (size_t) -1)
+		return NULL;
+	str = calloc(wlen + 1, sizeof(wchar_t));
+	if (str)
+		mbstowcs(str, buf, wlen + 1);
 
-								/* Manufacturer and Product strings */
-								if (desc.iManufacturer > 0)
-									cur_dev->manufacturer_string =
-										get_usb_string(handle, desc.iManufacturer);
-								if (desc.iProduct > 0)
-									cur_dev->product_string =
-										get_usb_string(handle, desc.iProduct);
+	return str;
+}
 
-#ifdef INVASIVE_GET_USAGE
+/* Read the report descriptor of an interface of dev which usbhid has
+   read, from sysfs. The HID device is a child of the interface's
+   directory, named <bus>:<vid>:<pid>.<id>. It isn't there unless usbhid
+   is bound to the interface.
+   The return value is the length of the descriptor, or -1 on failure. */
+static int get_sysfs_report_descriptor(libusb_device *dev, const struct libusb_device_descriptor *desc, int config, int interface_number, uint8_t *buf, size_t buf_size)
 {
-							/*
-							This section is removed because it is too
-							invasive on the system. Getting a Usage Page
-							and Usage requires parsing the HID Report
-							descriptor. Getting a HID Report descriptor
-							involves claiming the interface. Claiming the
-							interface involves detaching the kernel driver.
-							Detaching the kernel driver is hard on the system
-							because it will unclaim interfaces (if another
-							app has them claimed) and the re-attachment of
-							the driver will sometimes change /dev entry names.
-							It is for these reasons that this section is
-							#if 0. For composite devices, use the interface
-							field in the hid_device_info struct to distinguish
-							between interfaces. */
-								unsigned char data[256];
-#ifdef DETACH_KERNEL_DRIVER
-								int detached = 0;
-								/* Usage Page and Usage */
-								res = libusb_kernel_driver_active(handle, interface_num);
-								if (res == 1) {
-									res = libusb_detach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
-									else
-										detached = 1;
-								}
-#endif
-								res = libusb_claim_interface(handle, interface_num);
-								if (res >= 0) {
-									/* Get the HID Report Descriptor. */
-									res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
-									if (res >= 0) {
-										unsigned short page=0, usage=0;
-										/* Parse the usage and usage page
-										   out of the report descriptor. */
-										get_usage(data, res,  &page, &usage);
-										cur_dev->usage_page = page;
-										cur_dev->usage = usage;
-									}
-									else
-										LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
-
-									/* Release the interface */
-									res = libusb_release_interface(handle, interface_num);
-									if (res < 0)
-										LOG("Can't release the interface.\n");
-								}
-								else
-									LOG("Can't claim interface %d\n", res);
-#ifdef DETACH_KERNEL_DRIVER
-								/* Re-attach kernel driver if necessary. */
-								if (detached) {
-									res = libusb_attach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't re-attach kernel driver.\n");
-								}
-#endif
-}
-#endif /* INVASIVE_GET_USAGE */
+	char path[256];
+	DIR *dir;
+	struct dirent *ent;
+	int len, fd;
+	ssize_t size = -1;
 
-								libusb_close(handle);
-							}
-							/* VID/PID */
-							cur_dev->vendor_id = dev_vid;
-							cur_dev->product_id = dev_pid;
+	len = get_sysfs_device_path(dev, path, sizeof(path));
+	if (len < 0)
+		return -1;
+	len += snprintf(path + len, sizeof(path) - len, ":%d.%d", config, interface_number);
 
-							/* Release Number */
-							cur_dev->release_number = desc.bcdDevice;
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir)) != NULL) {
+		unsigned int bus, vendor_id, product_id, id;
 
-							/* Interface Number */
-							cur_dev->interface_number = interface_num;
-						}
-					}
-				} /* altsettings */
-			} /* interfaces */
-			libusb_free_config_descriptor(conf_desc);
+		if (sscanf(ent->d_name, "%x:%x:%x.%x", &bus, &vendor_id, &product_id, &id) != 4 ||
+		    vendor_id != desc->idVendor || product_id != desc->idProduct)
+			continue;
+
+		snprintf(path + len, sizeof(path) - len, "/%s/report_descriptor", ent->d_name);
+		fd = open(path, O_RDONLY|O_CLOEXEC);
+		if (fd >= 0) {
+			size = read(fd, buf, buf_size);
+			close(fd);
 		}
+		break;
 	}
+	closedir(dir);
 
-	libusb_free_device_list(devs, 1);
+	if (size <= 0)
+		return -1;
 
-	return root;
+	return (int) size;
+}
+#else
+static wchar_t *get_sysfs_usb_string(libusb_device *dev, enum hid_string_type type)
+{
+	return NULL;
 }
 
-void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+static int get_sysfs_report_descriptor(libusb_device *dev, const struct libusb_device_descriptor *desc, int config, int interface_number, uint8_t *buf, size_t buf_size)
 {
-	struct hid_device_info *d = devs;
-	while (d) {
-		struct hid_device_info *next = d->next;
-		free(d->path);
-		free(d->serial_number);
-		free(d->manufacturer_string);
-		free(d->product_string);
-		free(d);
-		d = next;
-	}
+	return -1;
 }
+#endif
 
-hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+/* Read the report descriptor of an interface of an open device. The
+   interface must be claimed, which means detaching the kernel driver
+   from it.
+   The return value is the length of the descriptor, or -1 on failure. */
+static int get_device_report_descriptor(libusb_device_handle *handle, int interface_num, uint8_t *buf, size_t buf_size)
 {
-	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
-	hid_device *handle = NULL;
+	int res;
 
-	devs = hid_enumerate(vendor_id, product_id);
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
-				if (cur_dev->serial_number &&
-				    wcscmp(serial_number, cur_dev->serial_number) == 0) {
-					path_to_open = cur_dev->path;
-					break;
-				}
-			}
-			else {
-				path_to_open = cur_dev->path;
-				break;
-			}
-		}
-		cur_dev = cur_dev->next;
+	res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, buf, buf_size, 5000);
+	if (res < 0) {
+		LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
+		return -1;
 	}
 
-	if (path_to_open) {
-		/* Open the device */
-		handle = hid_open_path(path_to_open);
+	return res;
+}
+
+/* What's used from the report descriptor of each interface which has
+   been seen, by VID, PID, bcdDevice and interface number, for when it
+   can't be read from sysfs: on other platforms, or while the kernel
+   driver is detached (as it is while the device is open). Devices of
+   one model and release have the same report descriptors. It's filled
+   from sysfs, and when a device is opened. */
+#define DESCRIPTOR_CACHE_SIZE 64 /* A power of two */
+#define MAX_DESCRIPTOR_CACHE_ENTRIES 1024
+
+/* HID_MAX_DESCRIPTOR_SIZE in Linux */
+#define MAX_REPORT_DESCRIPTOR_SIZE 4096
+
+struct descriptor_cache_entry {
+	unsigned short vendor_id;
+	unsigned short product_id;
+	unsigned short release_number;
+	int interface_number;
+	struct report_descriptor_info info;
+	struct descriptor_cache_entry *next;
+};
+
+static pthread_mutex_t descriptor_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct descriptor_cache_entry *descriptor_cache[DESCRIPTOR_CACHE_SIZE];
+static size_t num_descriptor_cache_entries = 0;
+
+static struct descriptor_cache_entry **find_descriptor_cache_entry(const struct libusb_device_descriptor *desc, int interface_number)
+{
+	struct descriptor_cache_entry **entry;
+	unsigned int hash = (((unsigned int) desc->idVendor << 16) | desc->idProduct) ^
+		((unsigned int) desc->bcdDevice << 4) ^ interface_number;
+
+	hash ^= hash >> 16;
+	entry = &descriptor_cache[hash & (DESCRIPTOR_CACHE_SIZE - 1)];
+	while (*entry) {
+		if ((*entry)->vendor_id == desc->idVendor &&
+		    (*entry)->product_id == desc->idProduct &&
+		    (*entry)->release_number == desc->bcdDevice &&
+		    (*entry)->interface_number == interface_number)
+			break;
+		entry = &(*entry)->next;
+	}
+
+	return entry;
+}
+
+/* Drop all of the entries. This should be called with
+   descriptor_cache_mutex locked. */
+static void clear_descriptor_cache_locked(void)
+{
+	size_t i;
+
+	for (i = 0; i < DESCRIPTOR_CACHE_SIZE; i++) {
+		while (descriptor_cache[i]) {
+			struct descriptor_cache_entry *next = descriptor_cache[i]->next;
+			free(descriptor_cache[i]);
+			descriptor_cache[i] = next;
+		}
+	}
+	num_descriptor_cache_entries = 0;
+}
+
+static void clear_descriptor_cache(void)
+{
+	pthread_mutex_lock(&descriptor_cache_mutex);
+	clear_descriptor_cache_locked();
+	pthread_mutex_unlock(&descriptor_cache_mutex);
+}
+
+/* The return value is 0 if the interface is cached, and -1 if it isn't. */
+static int lookup_descriptor_cache(const struct libusb_device_descriptor *desc, int interface_number, struct report_descriptor_info *info)
+{
+	struct descriptor_cache_entry *entry;
+
+	pthread_mutex_lock(&descriptor_cache_mutex);
+	entry = *find_descriptor_cache_entry(desc, interface_number);
+	if (entry)
+		*info = entry->info;
+	pthread_mutex_unlock(&descriptor_cache_mutex);
+
+	return entry? 0: -1;
+}
+
+static void add_descriptor_cache(const struct libusb_device_descriptor *desc, int interface_number, const struct report_descriptor_info *info)
+{
+	struct descriptor_cache_entry **slot, *entry;
+
+	pthread_mutex_lock(&descriptor_cache_mutex);
+	slot = find_descriptor_cache_entry(desc, interface_number);
+	entry = *slot;
+	if (!entry) {
+		/* Start again rather than grow without bound. */
+		if (num_descriptor_cache_entries >= MAX_DESCRIPTOR_CACHE_ENTRIES) {
+			clear_descriptor_cache_locked();
+			slot = find_descriptor_cache_entry(desc, interface_number);
+		}
+
+		entry = calloc(1, sizeof(struct descriptor_cache_entry));
+		if (entry) {
+			entry->vendor_id = desc->idVendor;
+			entry->product_id = desc->idProduct;
+			entry->release_number = desc->bcdDevice;
+			entry->interface_number = interface_number;
+			*slot = entry;
+			num_descriptor_cache_entries++;
+		}
+	}
+	if (entry)
+		entry->info = *info;
+	pthread_mutex_unlock(&descriptor_cache_mutex);
+}
+
+/* Read and parse the report descriptor of an interface from sysfs, and
+   cache what's found.
+   The return value is 0 on success and -1 on failure. */
+static int cache_sysfs_report_descriptor(libusb_device *dev, const struct libusb_device_descriptor *desc, int config, int interface_number, struct report_descriptor_info *info)
+{
+	uint8_t report_descriptor[MAX_REPORT_DESCRIPTOR_SIZE];
+	int len;
+
+	len = get_sysfs_report_descriptor(dev, desc, config, interface_number, report_descriptor, sizeof(report_descriptor));
+	if (len < 0)
+		return -1;
+
+	parse_report_descriptor(report_descriptor, len, info);
+	add_descriptor_cache(desc, interface_number, info);
+	return 0;
+}
+
+/* Read and parse the report descriptor of a claimed interface of an
+   open device, and cache what's found.
+   The return value is 0 on success and -1 on failure. */
+static int cache_device_report_descriptor(libusb_device_handle *handle, const struct libusb_device_descriptor *desc, int interface_number, struct report_descriptor_info *info)
+{
+	uint8_t report_descriptor[MAX_REPORT_DESCRIPTOR_SIZE];
+	int len;
+
+	len = get_device_report_descriptor(handle, interface_number, report_descriptor, sizeof(report_descriptor));
+	if (len < 0)
+		return -1;
+
+	parse_report_descriptor(report_descriptor, len, info);
+	add_descriptor_cache(desc, interface_number, info);
+	return 0;
+}
+
+/* Get what's used from the report descriptor of an interface without
+   touching the device: from sysfs if it's there, or else from the cache.
+   The return value is 0 on success and -1 if it isn't known. */
+static int get_interface_info(libusb_device *dev, const struct libusb_device_descriptor *desc, int config, int interface_number, struct report_descriptor_info *info)
+{
+	if (cache_sysfs_report_descriptor(dev, desc, config, interface_number, info) == 0)
+		return 0;
+
+	return lookup_descriptor_cache(desc, interface_number, info);
+}
+
+static char *make_path(libusb_device *dev, int interface_number)
+{
+	char str[64];
+	snprintf(str, sizeof(str), "%04x:%04x:%02x",
+		libusb_get_bus_number(dev),
+		libusb_get_device_address(dev),
+		interface_number);
+	str[sizeof(str)-1] = '\0';
+
+	return strdup(str);
+}
+
+
+int HID_API_EXPORT hid_init(void)
+{
+	if (!usb_context) {
+		const char *locale;
+
+		/* Init Libusb */
+		if (libusb_init(&usb_context))
+			return -1;
+
+		/* Set the locale if it's not set. */
+		locale = setlocale(LC_CTYPE, NULL);
+		if (!locale)
+			setlocale(LC_CTYPE, "");
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_init_ex(unsigned int flags)
+{
+	/* The other flags are hidraw only. */
+	if (flags & HID_INIT_LAZY_STRINGS)
+		lazy_strings = 1;
+	if (flags & HID_INIT_SHARED_EVENT_THREAD)
+		shared_event_thread = 1;
+
+	return hid_init();
+}
+
+int HID_API_EXPORT hid_exit(void)
+{
+	/* The index holds references to devices. */
+	clear_open_index();
+	clear_descriptor_cache();
+	lazy_strings = 0;
+
+	/* Any devices should be closed by now. */
+	stop_event_thread();
+	shared_event_thread = 0;
+
+#ifndef __ANDROID__
+	pthread_mutex_lock(&converter_mutex);
+	if (converter != (iconv_t)-1) {
+		iconv_close(converter);
+		converter = (iconv_t)-1;
+	}
+	pthread_mutex_unlock(&converter_mutex);
+#endif
+
+	if (usb_context) {
+		libusb_exit(usb_context);
+		usb_context = NULL;
+	}
+
+	return 0;
+}
+
+hid_enumeration_filter * HID_API_EXPORT hid_enumeration_filter_new(void)
+{
+	hid_enumeration_filter *filter = calloc(1, sizeof(hid_enumeration_filter));
+
+	if (!filter)
+		return NULL;
+	filter->interface_number = -1;
+
+	return filter;
+}
+
+void HID_API_EXPORT hid_enumeration_filter_free(hid_enumeration_filter *filter)
+{
+	if (!filter)
+		return;
+	free(filter->ids);
+	free(filter->serial_number);
+	free(filter);
+}
+
+/* Return the slot for id in filter's hash set: either the slot holding it,
+   or the empty slot where it belongs. */
+static unsigned int *find_id_slot(unsigned int *ids, size_t ids_size, unsigned int id)
+{
+	unsigned int hash = id * 2654435761u;
+	size_t i = (hash ^ (hash >> 16)) & (ids_size - 1);
+
+	while (ids[i] != 0 && ids[i] != id)
+		i = (i + 1) & (ids_size - 1);
+
+	return &ids[i];
+}
+
+int HID_API_EXPORT hid_enumeration_filter_add_id(hid_enumeration_filter *filter, unsigned short vendor_id, unsigned short product_id)
+{
+	unsigned int id = ((unsigned int) vendor_id << 16) | product_id;
+	unsigned int *slot;
+
+	if (id == 0) {
+		filter->match_any_id = 1;
+		return 0;
+	}
+
+	/* Keep the set at most half full. */
+	if ((filter->num_ids + 1) * 2 > filter->ids_size) {
+		size_t new_size = filter->ids_size? filter->ids_size * 2: 16;
+		unsigned int *new_ids = calloc(new_size, sizeof(unsigned int));
+		size_t i;
+
+		if (!new_ids)
+			return -1;
+		for (i = 0; i < filter->ids_size; i++) {
+			if (filter->ids[i])
+				*find_id_slot(new_ids, new_size, filter->ids[i]) = filter->ids[i];
+		}
+		free(filter->ids);
+		filter->ids = new_ids;
+		filter->ids_size = new_size;
+	}
+
+	slot = find_id_slot(filter->ids, filter->ids_size, id);
+	if (*slot == 0) {
+		*slot = id;
+		filter->num_ids++;
+	}
+
+	return 0;
+}
+
+void HID_API_EXPORT hid_enumeration_filter_set_bus_type(hid_enumeration_filter *filter, enum hid_bus_type bus_type)
+{
+	filter->bus_type = bus_type;
+}
+
+void HID_API_EXPORT hid_enumeration_filter_set_interface(hid_enumeration_filter *filter, int interface_number)
+{
+	filter->interface_number = interface_number;
+}
+
+void HID_API_EXPORT hid_enumeration_filter_set_usage(hid_enumeration_filter *filter, unsigned short usage_page, unsigned short usage)
+{
+	filter->usage_page = usage_page;
+	filter->usage = usage;
+}
+
+int HID_API_EXPORT hid_enumeration_filter_set_serial_number(hid_enumeration_filter *filter, const wchar_t *serial_number)
+{
+	wchar_t *copy = NULL;
+
+	if (serial_number) {
+		copy = wcsdup(serial_number);
+		if (!copy)
+			return -1;
+	}
+	free(filter->serial_number);
+	filter->serial_number = copy;
+
+	return 0;
+}
+
+/* 0 marks the set's empty slots, so it's never in the set (0:0 sets
+   match_any_id instead). */
+static int filter_has_id(const hid_enumeration_filter *filter, unsigned int id)
+{
+	if (id == 0)
+		return 0;
+	return *find_id_slot(filter->ids, filter->ids_size, id) == id;
+}
+
+/* Check a device's IDs, from its device descriptor, against filter. */
+static int filter_match_ids(const hid_enumeration_filter *filter, unsigned short vendor_id, unsigned short product_id)
+{
+	if (filter->num_ids == 0 || filter->match_any_id)
+		return 1;
+
+	/* The device matches vendor:product, vendor:0 or 0:product. A
+	   device with a vendor or product ID of 0 only matches the
+	   wildcards by its other ID. */
+	return filter_has_id(filter, ((unsigned int) vendor_id << 16) | product_id) ||
+	       (vendor_id != 0 && filter_has_id(filter, (unsigned int) vendor_id << 16)) ||
+	       (product_id != 0 && filter_has_id(filter, product_id));
+}
+
+static int filter_match_serial(const hid_enumeration_filter *filter, const struct hid_device_info *info)
+{
+	return !filter->serial_number ||
+		(info->serial_number && wcscmp(filter->serial_number, info->serial_number) == 0);
+}
+
+/* A usage which isn't known has a usage_page of 0, and doesn't match. */
+static int filter_match_usage(const hid_enumeration_filter *filter, const struct hid_device_info *info)
+{
+	return filter->usage_page == 0 ||
+		(info->usage_page == filter->usage_page &&
+		 (filter->usage == 0 || info->usage == filter->usage));
+}
+
+/* Open dev and read the strings of its record info. The manufacturer and
+   product strings aren't read if the serial number doesn't match filter.
+   With INVASIVE_GET_USAGE, the usage is read too, if it isn't known. */
+static void read_device_strings(libusb_device *dev, const struct libusb_device_descriptor *desc, struct hid_device_info *info, const hid_enumeration_filter *filter)
+{
+	libusb_device_handle *handle;
+	int need_strings = 0;
+	int need_usage = 0;
+	uint16_t lang = 0x0;
+	int res;
+
+	/* Take what the kernel has already read from sysfs (on Linux). The
+	   device is only opened for the rest. */
+	if (desc->iSerialNumber > 0) {
+		info->serial_number = get_sysfs_usb_string(dev, HID_STRING_SERIAL_NUMBER);
+		need_strings |= !info->serial_number;
+	}
+	if (filter_match_serial(filter, info)) {
+		if (desc->iManufacturer > 0) {
+			info->manufacturer_string = get_sysfs_usb_string(dev, HID_STRING_MANUFACTURER);
+			need_strings |= !info->manufacturer_string;
+		}
+		if (desc->iProduct > 0) {
+			info->product_string = get_sysfs_usb_string(dev, HID_STRING_PRODUCT);
+			need_strings |= !info->product_string;
+		}
+	}
+#ifdef INVASIVE_GET_USAGE
+	need_usage = info->usage_page == 0 && filter_match_serial(filter, info);
+#endif
+	if (!need_strings && !need_usage)
+		return;
+
+	res = libusb_open(dev, &handle);
+	if (res < 0)
+		return;
+
+	/* The language is asked for once, for all of the strings. */
+	if (need_strings)
+		lang = get_language(handle);
+
+	/* Serial Number */
+	if (desc->iSerialNumber > 0 && !info->serial_number)
+		info->serial_number =
+			get_usb_string(handle, desc->iSerialNumber, lang);
+
+	/* Manufacturer and Product strings, which aren't needed if the
+	   serial number doesn't match. */
+	if (desc->iManufacturer > 0 && !info->manufacturer_string &&
+	    filter_match_serial(filter, info))
+		info->manufacturer_string =
+			get_usb_string(handle, desc->iManufacturer, lang);
+	if (desc->iProduct > 0 && !info->product_string &&
+	    filter_match_serial(filter, info))
+		info->product_string =
+			get_usb_string(handle, desc->iProduct, lang);
+
+#ifdef INVASIVE_GET_USAGE
+if (need_usage) {
+	/*
+	This section is removed because it is too
+	invasive on the system. Getting a Usage Page
+	and Usage requires parsing the HID Report
+	descriptor. Getting a HID Report descriptor
+	involves claiming the interface. Claiming the
+	interface involves detaching the kernel driver.
+	Detaching the kernel driver is hard on the system
+	because it will unclaim interfaces (if another
+	app has them claimed) and the re-attachment of
+	the driver will sometimes change /dev entry names.
+	It is for these reasons that this section is
+	#if 0. For composite devices, use the interface
+	field in the hid_device_info struct to distinguish
+	between interfaces. */
+		int interface_num = info->interface_number;
+		struct report_descriptor_info descriptor_info;
+#ifdef DETACH_KERNEL_DRIVER
+		int detached = 0;
+		/* Usage Page and Usage */
+		res = libusb_kernel_driver_active(handle, interface_num);
+		if (res == 1) {
+			res = libusb_detach_kernel_driver(handle, interface_num);
+			if (res < 0)
+				LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
+			else
+				detached = 1;
+		}
+#endif
+		res = libusb_claim_interface(handle, interface_num);
+		if (res >= 0) {
+			/* Get the HID Report Descriptor. */
+			if (cache_device_report_descriptor(handle, desc, interface_num, &descriptor_info) == 0) {
+				info->usage_page = descriptor_info.usage_page;
+				info->usage = descriptor_info.usage;
+			}
+
+			/* Release the interface */
+			res = libusb_release_interface(handle, interface_num);
+			if (res < 0)
+				LOG("Can't release the interface.\n");
+		}
+		else
+			LOG("Can't claim interface %d\n", res);
+#ifdef DETACH_KERNEL_DRIVER
+		/* Re-attach kernel driver if necessary. */
+		if (detached) {
+			res = libusb_attach_kernel_driver(handle, interface_num);
+			if (res < 0)
+				LOG("Couldn't re-attach kernel driver.\n");
+		}
+#endif
+}
+#endif /* INVASIVE_GET_USAGE */
+
+	libusb_close(handle);
+}
+
+/* Free the record last returned by hid_enumerate_next(). */
+static void clear_enumeration_record(hid_enumeration *enumeration)
+{
+	struct hid_device_info *info = &enumeration->info;
+
+	free(info->path);
+	free(info->serial_number);
+	free(info->manufacturer_string);
+	free(info->product_string);
+	memset(info, 0, sizeof(*info));
+	enumeration->have_strings = 0;
+}
+
+hid_enumeration * HID_API_EXPORT hid_enumerate_begin(const hid_enumeration_filter *filter)
+{
+	hid_enumeration *enumeration;
+
+	if(hid_init() < 0)
+		return NULL;
+
+	enumeration = calloc(1, sizeof(hid_enumeration));
+	if (!enumeration)
+		return NULL;
+	enumeration->filter = filter? filter: &match_all_filter;
+
+	/* libusb only finds USB devices. */
+	if (enumeration->filter->bus_type != HID_API_BUS_UNKNOWN &&
+	    enumeration->filter->bus_type != HID_API_BUS_USB)
+		return enumeration;
+
+	enumeration->num_devs = libusb_get_device_list(usb_context, &enumeration->devs);
+	if (enumeration->num_devs < 0) {
+		free(enumeration);
+		return NULL;
+	}
+
+	return enumeration;
+}
+
+const struct hid_device_info HID_API_EXPORT *hid_enumerate_next(hid_enumeration *enumeration)
+{
+	const hid_enumeration_filter *filter = enumeration->filter;
+	struct hid_device_info *info = &enumeration->info;
+	int res;
+
+	clear_enumeration_record(enumeration);
+
+	while (1) {
+		/* The next HID interface of the current device */
+		while (enumeration->conf_desc &&
+		       enumeration->intf_index < enumeration->conf_desc->bNumInterfaces) {
+			const struct libusb_interface *intf = &enumeration->conf_desc->interface[enumeration->intf_index];
+			const struct libusb_interface_descriptor *intf_desc;
+			int interface_num;
+			struct report_descriptor_info descriptor_info;
+			int need_strings;
+
+			if (enumeration->alt_index >= intf->num_altsetting) {
+				enumeration->intf_index++;
+				enumeration->alt_index = 0;
+				continue;
+			}
+			intf_desc = &intf->altsetting[enumeration->alt_index++];
+			if (intf_desc->bInterfaceClass != LIBUSB_CLASS_HID)
+				continue;
+			interface_num = intf_desc->bInterfaceNumber;
+
+			/* Check the interface against the filter */
+			if (filter->interface_number != -1 &&
+			    filter->interface_number != interface_num)
+				continue;
+
+			/* The usage, if it can be found without touching the
+			   device */
+			if (get_interface_info(enumeration->dev, &enumeration->desc,
+			                       enumeration->conf_desc->bConfigurationValue, interface_num,
+			                       &descriptor_info) == 0) {
+				info->usage_page = descriptor_info.usage_page;
+				info->usage = descriptor_info.usage;
+				need_strings = 0;
+			}
+			else {
+#ifdef INVASIVE_GET_USAGE
+				/* It's read along with the strings. */
+				need_strings = 1;
+#else
+				need_strings = 0;
+#endif
+			}
+			if (!need_strings && !filter_match_usage(filter, info)) {
+				clear_enumeration_record(enumeration);
+				continue;
+			}
+			if (filter->serial_number)
+				need_strings = 1;
+
+			/* Fill out the record */
+			info->path = make_path(enumeration->dev, interface_num);
+			info->vendor_id = enumeration->desc.idVendor;
+			info->product_id = enumeration->desc.idProduct;
+			info->release_number = enumeration->desc.bcdDevice;
+			info->interface_number = interface_num;
+
+			/* The device is only opened here if the filter needs
+			   its strings. */
+			if (need_strings) {
+				read_device_strings(enumeration->dev, &enumeration->desc, info, filter);
+				enumeration->have_strings = 1;
+				if (!filter_match_serial(filter, info) ||
+				    !filter_match_usage(filter, info)) {
+					clear_enumeration_record(enumeration);
+					continue;
+				}
+			}
+
+			return info;
+		}
+
+		if (enumeration->conf_desc) {
+			libusb_free_config_descriptor(enumeration->conf_desc);
+			enumeration->conf_desc = NULL;
+		}
+
+		/* The next device */
+		if (enumeration->next_dev >= enumeration->num_devs)
+			return NULL;
+		enumeration->dev = enumeration->devs[enumeration->next_dev++];
+		res = libusb_get_device_descriptor(enumeration->dev, &enumeration->desc);
+		if (res < 0)
+			continue;
+
+		/* Check the VID/PID against the filter, before looking any
+		   further at the device. */
+		if (!filter_match_ids(filter, enumeration->desc.idVendor, enumeration->desc.idProduct))
+			continue;
+
+		res = libusb_get_active_config_descriptor(enumeration->dev, &enumeration->conf_desc);
+		if (res < 0)
+			libusb_get_config_descriptor(enumeration->dev, 0, &enumeration->conf_desc);
+		enumeration->intf_index = 0;
+		enumeration->alt_index = 0;
+	}
+}
+
+/* The field of info for a string type, or NULL */
+static wchar_t **device_info_string(struct hid_device_info *info, enum hid_string_type type)
+{
+	switch (type) {
+	case HID_STRING_MANUFACTURER:
+		return &info->manufacturer_string;
+	case HID_STRING_PRODUCT:
+		return &info->product_string;
+	case HID_STRING_SERIAL_NUMBER:
+		return &info->serial_number;
+	}
+
+	return NULL;
+}
+
+const wchar_t HID_API_EXPORT *hid_enumerate_get_string(hid_enumeration *enumeration, enum hid_string_type type)
+{
+	struct hid_device_info *info = &enumeration->info;
+	wchar_t **string;
+
+	if (!info->path)
+		return NULL;
+
+	/* Open the device the first time one of its strings is asked for. */
+	if (!enumeration->have_strings) {
+		read_device_strings(enumeration->dev, &enumeration->desc, info, enumeration->filter);
+		enumeration->have_strings = 1;
+	}
+
+	string = device_info_string(info, type);
+
+	return string? *string: NULL;
+}
+
+void HID_API_EXPORT hid_enumerate_end(hid_enumeration *enumeration)
+{
+	if (!enumeration)
+		return;
+
+	clear_enumeration_record(enumeration);
+	if (enumeration->conf_desc)
+		libusb_free_config_descriptor(enumeration->conf_desc);
+	if (enumeration->devs)
+		libusb_free_device_list(enumeration->devs, 1);
+	free(enumeration);
+}
+
+/* A record in a flat_arena. Its strings are kept as offsets, since the
+   arena's buffers move as they grow: 0 is NULL, and otherwise it's the
+   offset plus 1. */
+struct flat_record {
+	struct hid_device_info info; /* Without strings or path */
+	size_t path; /* In paths */
+	size_t strings[NUM_DEVICE_STRINGS]; /* In wide, by hid_string_type */
+};
+
+/* The records of hid_enumerate_flat(), which are added to it as the
+   devices are found, along with their strings. Wide strings are only
+   stored once. flat_arena_finish() packs it all into one block. */
+struct flat_arena {
+	struct flat_record *records;
+	size_t num_records, records_size;
+	wchar_t *wide;
+	size_t wide_len, wide_size;
+	char *paths;
+	size_t paths_len, paths_size;
+	size_t *table; /* Open-addressed hash set of the wide strings */
+	size_t table_size; /* A power of two */
+	size_t table_used;
+	int failed; /* Out of memory */
+};
+
+static void flat_arena_init(struct flat_arena *arena)
+{
+	memset(arena, 0, sizeof(struct flat_arena));
+}
+
+static void flat_arena_free(struct flat_arena *arena)
+{
+	free(arena->records);
+	free(arena->wide);
+	free(arena->paths);
+	free(arena->table);
+	flat_arena_init(arena);
+}
+
+/* Make room for needed elements of elem_size in array, which has room for
+   *size of them, doubling it. Returns the new array, or NULL (leaving
+   array as it is) if there's not enough memory. */
+static void *grow_array(void *array, size_t *size, size_t needed, size_t elem_size)
+{
+	size_t new_size = *size? *size: 16;
+	void *new_array;
+
+	while (new_size < needed)
+		new_size *= 2;
+	new_array = realloc(array, new_size * elem_size);
+	if (new_array)
+		*size = new_size;
+
+	return new_array;
+}
+
+/* Hash a wide string, for interning in a flat_arena. */
+static unsigned int hash_wcs(const wchar_t *s)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*s)
+		hash = (hash ^ (unsigned int) *s++) * 16777619u;
+
+	return hash;
+}
+
+/* Find the slot in arena's table for s: where it is, or where it goes. */
+static size_t *find_wide_slot(struct flat_arena *arena, const wchar_t *s)
+{
+	size_t i = hash_wcs(s) & (arena->table_size - 1);
+
+	while (arena->table[i] && wcscmp(arena->wide + arena->table[i] - 1, s) != 0)
+		i = (i + 1) & (arena->table_size - 1);
+
+	return &arena->table[i];
+}
+
+/* Copy s into the space after arena's wide strings, without adding it.
+   Returns where it is, which is only good until the arena grows, or
+   NULL. */
+static const wchar_t *put_wcs(struct flat_arena *arena, const wchar_t *s)
+{
+	size_t len;
+
+	if (!s)
+		return NULL;
+
+	len = wcslen(s) + 1;
+	if (arena->wide_len + len > arena->wide_size) {
+		wchar_t *wide = grow_array(arena->wide, &arena->wide_size, arena->wide_len + len, sizeof(wchar_t));
+		if (!wide) {
+			arena->failed = 1;
+			return NULL;
+		}
+		arena->wide = wide;
+	}
+
+	return wcscpy(arena->wide + arena->wide_len, s);
+}
+
+/* Add the string which put_wcs() put after arena's wide strings, unless
+   an equal one is already there. Returns its offset plus 1, or 0 for
+   NULL. */
+static size_t intern_wide(struct flat_arena *arena, const wchar_t *s)
+{
+	size_t *slot;
+
+	if (!s)
+		return 0;
+
+	/* Keep the table at most half full. */
+	if ((arena->table_used + 1) * 2 > arena->table_size) {
+		size_t *old_table = arena->table;
+		size_t old_size = arena->table_size;
+		size_t new_size = old_size? old_size * 2: 64;
+		size_t i;
+
+		arena->table = calloc(new_size, sizeof(size_t));
+		if (!arena->table) {
+			arena->table = old_table;
+			arena->failed = 1;
+			return 0;
+		}
+		arena->table_size = new_size;
+		for (i = 0; i < old_size; i++) {
+			if (old_table[i])
+				*find_wide_slot(arena, arena->wide + old_table[i] - 1) = old_table[i];
+		}
+		free(old_table);
+	}
+
+	slot = find_wide_slot(arena, s);
+	if (!*slot) {
+		*slot = arena->wide_len + 1;
+		arena->wide_len += wcslen(s) + 1;
+		arena->table_used++;
+	}
+
+	return *slot;
+}
+
+/* Add path to arena. Returns its offset plus 1, or 0 for NULL. */
+static size_t add_path(struct flat_arena *arena, const char *path)
+{
+	size_t len;
+	size_t offset;
+
+	if (!path)
+		return 0;
+
+	len = strlen(path) + 1;
+	if (arena->paths_len + len > arena->paths_size) {
+		char *paths = grow_array(arena->paths, &arena->paths_size, arena->paths_len + len, 1);
+		if (!paths) {
+			arena->failed = 1;
+			return 0;
+		}
+		arena->paths = paths;
+	}
+	memcpy(arena->paths + arena->paths_len, path, len);
+	offset = arena->paths_len + 1;
+	arena->paths_len += len;
+
+	return offset;
+}
+
+/* Add a copy of info to arena. Returns -1 if there's not enough
+   memory. */
+static int flat_arena_add_info(struct flat_arena *arena, const struct hid_device_info *info)
+{
+	struct flat_record *rec;
+
+	if (arena->num_records == arena->records_size) {
+		struct flat_record *records = grow_array(arena->records, &arena->records_size, arena->num_records + 1, sizeof(struct flat_record));
+		if (!records) {
+			arena->failed = 1;
+			return -1;
+		}
+		arena->records = records;
+	}
+
+	rec = &arena->records[arena->num_records++];
+	rec->info = *info;
+	rec->path = add_path(arena, info->path);
+	rec->strings[HID_STRING_MANUFACTURER] = intern_wide(arena, put_wcs(arena, info->manufacturer_string));
+	rec->strings[HID_STRING_PRODUCT] = intern_wide(arena, put_wcs(arena, info->product_string));
+	rec->strings[HID_STRING_SERIAL_NUMBER] = intern_wide(arena, put_wcs(arena, info->serial_number));
+
+	return 0;
+}
+
+/* Pack arena into one block, as returned by hid_enumerate_flat(): the
+   array of records, then their wide strings, then their paths. The
+   arena is freed. */
+static struct hid_device_info *flat_arena_finish(struct flat_arena *arena, size_t *num_devices)
+{
+	struct hid_device_info *devs = NULL;
+	size_t n = arena->num_records;
+	size_t i;
+	int j;
+
+	*num_devices = 0;
+	if (arena->failed || n == 0) {
+		flat_arena_free(arena);
+		return NULL;
+	}
+
+	devs = malloc(n * sizeof(struct hid_device_info) +
+		arena->wide_len * sizeof(wchar_t) + arena->paths_len);
+	if (devs) {
+		wchar_t *wide = (wchar_t *) (devs + n);
+		char *paths = (char *) (wide + arena->wide_len);
+
+		memcpy(wide, arena->wide, arena->wide_len * sizeof(wchar_t));
+		memcpy(paths, arena->paths, arena->paths_len);
+		for (i = 0; i < n; i++) {
+			const struct flat_record *rec = &arena->records[i];
+
+			devs[i] = rec->info;
+			devs[i].next = (i + 1 < n)? &devs[i+1]: NULL;
+			devs[i].path = rec->path? paths + rec->path - 1: NULL;
+			for (j = 0; j < NUM_DEVICE_STRINGS; j++)
+				*device_info_string(&devs[i], (enum hid_string_type) j) = rec->strings[j]? wide + rec->strings[j] - 1: NULL;
+		}
+		*num_devices = n;
+	}
+	flat_arena_free(arena);
+
+	return devs;
+}
+
+/* The strings of all of the devices in an enumeration are read at once,
+   by read_strings_async(), and must be read within this time. */
+#define ENUMERATION_STRINGS_TIMEOUT_MS 1000
+
+struct string_request;
+
+/* A string descriptor being read for a string_request */
+struct string_transfer {
+	struct string_request *request;
+	int type; /* An enum hid_string_type, or -1 for the language IDs */
+	struct libusb_transfer *transfer; /* While it's in flight */
+	unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + 255];
+};
+
+/* The transfers of one read_strings_async() */
+struct string_batch {
+	pthread_mutex_t mutex; /* Protects the transfers and pending */
+	int pending; /* Transfers in flight */
+	int completed; /* Set once pending reaches 0 */
+	unsigned long long deadline; /* See get_timestamp() */
+};
+
+/* A device whose strings are read by read_strings_async(), for its
+   records */
+struct string_request {
+	libusb_device *dev;
+	struct libusb_device_descriptor desc;
+	struct hid_device_info *info; /* The first of the device's records */
+	size_t first_record; /* Or its index, in a flat_arena */
+	int num_infos; /* Which follow each other in the list */
+
+	struct string_batch *batch;
+	libusb_device_handle *handle;
+	struct string_transfer langids;
+	struct string_transfer transfers[NUM_DEVICE_STRINGS];
+	wchar_t *strings[NUM_DEVICE_STRINGS];
+};
+
+static void read_string_callback(struct libusb_transfer *transfer);
+
+/* The index of a string type in desc */
+static uint8_t string_index(const struct libusb_device_descriptor *desc, int type)
+{
+	switch (type) {
+	case HID_STRING_MANUFACTURER:
+		return desc->iManufacturer;
+	case HID_STRING_PRODUCT:
+		return desc->iProduct;
+	case HID_STRING_SERIAL_NUMBER:
+		return desc->iSerialNumber;
+	}
+
+	return 0;
+}
+
+/* Check whether request has strings which the device must be asked for */
+static int missing_strings(const struct string_request *request)
+{
+	int i;
+
+	for (i = 0; i < NUM_DEVICE_STRINGS; i++) {
+		if (string_index(&request->desc, i) > 0 && !request->strings[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Submit a transfer to read string descriptor idx. It times out at the
+   batch's deadline. This should be called with the batch's mutex
+   locked. */
+static int submit_string_transfer(struct string_transfer *st, uint8_t idx, uint16_t lang)
+{
+	struct string_batch *batch = st->request->batch;
+	unsigned long long now = get_timestamp();
+
+	if (now >= batch->deadline)
+		return -1;
+
+	st->transfer = libusb_alloc_transfer(0);
+	if (!st->transfer)
+		return -1;
+	libusb_fill_control_setup(st->buffer,
+		LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_DESCRIPTOR,
+		(LIBUSB_DT_STRING << 8) | idx,
+		lang,
+		sizeof(st->buffer) - LIBUSB_CONTROL_SETUP_SIZE);
+	libusb_fill_control_transfer(st->transfer, st->request->handle,
+		st->buffer, read_string_callback, st,
+		(batch->deadline - now) / 1000000 + 1);
+	if (libusb_submit_transfer(st->transfer) < 0) {
+		libusb_free_transfer(st->transfer);
+		st->transfer = NULL;
+		return -1;
+	}
+	batch->pending++;
+
+	return 0;
+}
+
+/* Called, by whichever thread is handling libusb's events, when a string
+   transfer has finished. Once the language IDs arrive, the strings are
+   asked for. */
+static void read_string_callback(struct libusb_transfer *transfer)
+{
+	struct string_transfer *st = transfer->user_data;
+	struct string_request *request = st->request;
+	struct string_batch *batch = request->batch;
+	const unsigned char *data = libusb_control_transfer_get_data(transfer);
+	int ok = (transfer->status == LIBUSB_TRANSFER_COMPLETED);
+
+	pthread_mutex_lock(&batch->mutex);
+	if (st->type < 0) {
+		/* As get_language(), a device which doesn't list
+		   languages is asked in language 0. */
+		uint16_t lang = ok? choose_language(data, transfer->actual_length): 0x0;
+		int i;
+
+		for (i = 0; i < NUM_DEVICE_STRINGS; i++) {
+			uint8_t idx = string_index(&request->desc, i);
+			if (idx > 0 && !request->strings[i])
+				submit_string_transfer(&request->transfers[i], idx, lang);
+		}
+	}
+	else if (ok) {
+		request->strings[st->type] = usb_string_to_wchar_t(data, transfer->actual_length);
+	}
+
+	st->transfer = NULL;
+	libusb_free_transfer(transfer);
+	batch->pending--;
+	if (batch->pending == 0)
+		batch->completed = 1;
+	pthread_mutex_unlock(&batch->mutex);
+}
+
+static void cancel_string_transfer(struct string_transfer *st)
+{
+	if (st->transfer)
+		libusb_cancel_transfer(st->transfer);
+}
+
+/* Read the strings of the devices of requests, concurrently rather than
+   one device at a time, so that a slow device only holds up its own
+   strings. Whatever hasn't arrived by the deadline is left out. */
+static void read_strings_async(struct string_request *requests, size_t num_requests)
+{
+	struct string_batch batch;
+	int cancelled = 0;
+	size_t i;
+	int j;
+
+	pthread_mutex_init(&batch.mutex, NULL);
+	batch.pending = 0;
+	batch.completed = 0;
+	batch.deadline = get_timestamp() + ENUMERATION_STRINGS_TIMEOUT_MS * 1000000ULL;
+
+	/* Open the devices, and ask each for its language IDs. */
+	pthread_mutex_lock(&batch.mutex);
+	for (i = 0; i < num_requests; i++) {
+		struct string_request *request = &requests[i];
+
+		request->batch = &batch;
+		request->langids.request = request;
+		request->langids.type = -1;
+		for (j = 0; j < NUM_DEVICE_STRINGS; j++) {
+			request->transfers[j].request = request;
+			request->transfers[j].type = j;
+		}
+
+		/* Take what the kernel has already read from sysfs (on
+		   Linux). The device is only asked for the rest. */
+		for (j = 0; j < NUM_DEVICE_STRINGS; j++) {
+			if (string_index(&request->desc, j) > 0)
+				request->strings[j] = get_sysfs_usb_string(request->dev, (enum hid_string_type) j);
+		}
+		if (!missing_strings(request))
+			continue;
+		if (libusb_open(request->dev, &request->handle) < 0) {
+			request->handle = NULL;
+			continue;
+		}
+		submit_string_transfer(&request->langids, 0x0, 0x0);
+	}
+	if (batch.pending == 0)
+		batch.completed = 1;
+	pthread_mutex_unlock(&batch.mutex);
+
+	/* Wait for them, and for the strings which are asked for as they
+	   arrive. At the deadline, anything still in flight is cancelled,
+	   and the cancellations are waited for. */
+	while (1) {
+		unsigned long long now = get_timestamp();
+		unsigned long long wait = 100000000ULL;
+		struct timeval tv;
+		int pending;
+
+		pthread_mutex_lock(&batch.mutex);
+		pending = batch.pending;
+		if (pending && now >= batch.deadline && !cancelled) {
+			for (i = 0; i < num_requests; i++) {
+				cancel_string_transfer(&requests[i].langids);
+				for (j = 0; j < NUM_DEVICE_STRINGS; j++)
+					cancel_string_transfer(&requests[i].transfers[j]);
+			}
+			cancelled = 1;
+		}
+		pthread_mutex_unlock(&batch.mutex);
+		if (!pending)
+			break;
+
+		if (now < batch.deadline)
+			wait = batch.deadline - now;
+		tv.tv_sec = wait / 1000000000ULL;
+		tv.tv_usec = (wait % 1000000000ULL) / 1000;
+		libusb_handle_events_timeout_completed(usb_context, &tv, &batch.completed);
+	}
+
+	for (i = 0; i < num_requests; i++) {
+		if (requests[i].handle)
+			libusb_close(requests[i].handle);
+	}
+	pthread_mutex_destroy(&batch.mutex);
+}
+
+/* Give the strings from read_strings_async() to request's records. */
+static void set_request_strings(struct string_request *request)
+{
+	struct hid_device_info *info = request->info;
+	int i, j;
+
+	for (i = 0; i < request->num_infos; i++, info = info->next) {
+		for (j = 0; j < NUM_DEVICE_STRINGS; j++) {
+			wchar_t **string = device_info_string(info, (enum hid_string_type) j);
+			if (!request->strings[j])
+				continue;
+			if (i == request->num_infos - 1) {
+				*string = request->strings[j];
+				request->strings[j] = NULL;
+			}
+			else {
+				*string = wcsdup(request->strings[j]);
+			}
+		}
+	}
+}
+
+/* Give the strings from read_strings_async() to request's records in
+   arena. */
+static void set_request_strings_flat(struct string_request *request, struct flat_arena *arena)
+{
+	int i, j;
+
+	for (j = 0; j < NUM_DEVICE_STRINGS; j++) {
+		size_t string;
+
+		if (!request->strings[j])
+			continue;
+		string = intern_wide(arena, put_wcs(arena, request->strings[j]));
+		for (i = 0; i < request->num_infos; i++)
+			arena->records[request->first_record + i].strings[j] = string;
+		free(request->strings[j]);
+		request->strings[j] = NULL;
+	}
+}
+
+/* hid_enumerate_filtered(), with or without the strings (other than a
+   serial number which filter needs). With an arena, the records are added
+   to it for hid_enumerate_flat() instead, and NULL is returned. */
+static struct hid_device_info *enumerate_devices(const hid_enumeration_filter *filter, int with_strings, struct flat_arena *arena)
+{
+	hid_enumeration *enumeration;
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info *cur_dev = NULL;
+	struct string_request *requests = NULL;
+	size_t num_requests = 0, requests_size = 0;
+	size_t i;
+
+	enumeration = hid_enumerate_begin(filter);
+	if (!enumeration)
+		return NULL;
+
+	while (hid_enumerate_next(enumeration)) {
+		struct hid_device_info *tmp = NULL;
+
+		if (arena) {
+			/* Copy the record into the arena. */
+			if (flat_arena_add_info(arena, &enumeration->info) < 0)
+				break;
+		}
+		else {
+			/* Take the record. */
+			tmp = malloc(sizeof(struct hid_device_info));
+			if (!tmp)
+				break;
+			*tmp = enumeration->info;
+			tmp->next = NULL;
+			memset(&enumeration->info, 0, sizeof(enumeration->info));
+
+			if (cur_dev) {
+				cur_dev->next = tmp;
+			}
+			else {
+				root = tmp;
+			}
+			cur_dev = tmp;
+		}
+
+		/* Unless they were read to check the filter, the strings are
+		   read below, for all of the devices at once. A device's
+		   records follow each other. */
+		if (!with_strings || enumeration->have_strings)
+			continue;
+		if (num_requests > 0 && requests[num_requests-1].dev == enumeration->dev) {
+			requests[num_requests-1].num_infos++;
+			continue;
+		}
+		if (num_requests == requests_size) {
+			size_t new_size = requests_size? requests_size * 2: 16;
+			struct string_request *new_requests = realloc(requests, new_size * sizeof(struct string_request));
+			if (!new_requests)
+				continue;
+			requests = new_requests;
+			requests_size = new_size;
+		}
+		memset(&requests[num_requests], 0, sizeof(struct string_request));
+		requests[num_requests].dev = enumeration->dev;
+		requests[num_requests].desc = enumeration->desc;
+		requests[num_requests].info = tmp;
+		if (arena)
+			requests[num_requests].first_record = arena->num_records - 1;
+		requests[num_requests].num_infos = 1;
+		num_requests++;
+	}
+
+	/* The devices are still in the enumeration's list. */
+	if (num_requests > 0) {
+		read_strings_async(requests, num_requests);
+		for (i = 0; i < num_requests; i++) {
+			if (arena)
+				set_request_strings_flat(&requests[i], arena);
+			else
+				set_request_strings(&requests[i]);
+		}
+	}
+	free(requests);
+
+	hid_enumerate_end(enumeration);
+
+	return root;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_filtered(const hid_enumeration_filter *filter)
+{
+	return enumerate_devices(filter, !lazy_strings, NULL);
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	hid_enumeration_filter *filter;
+	struct hid_device_info *root;
+
+	filter = hid_enumeration_filter_new();
+	if (!filter || hid_enumeration_filter_add_id(filter, vendor_id, product_id) < 0) {
+		hid_enumeration_filter_free(filter);
+		return NULL;
+	}
+	root = hid_enumerate_filtered(filter);
+	hid_enumeration_filter_free(filter);
+
+	return root;
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	struct hid_device_info *d = devs;
+	while (d) {
+		struct hid_device_info *next = d->next;
+		free(d->path);
+		free(d->serial_number);
+		free(d->manufacturer_string);
+		free(d->product_string);
+		free(d);
+		d = next;
+	}
+}
+
+struct hid_device_info HID_API_EXPORT *hid_enumerate_flat(const hid_enumeration_filter *filter, size_t *num_devices)
+{
+	struct flat_arena arena;
+
+	flat_arena_init(&arena);
+	enumerate_devices(filter, 1, &arena);
+
+	return flat_arena_finish(&arena, num_devices);
+}
+
+void HID_API_EXPORT hid_free_flat_enumeration(struct hid_device_info *devs)
+{
+	/* It's all one block. */
+	free(devs);
+}
+
+const wchar_t HID_API_EXPORT *hid_device_info_get_string(struct hid_device_info *info, enum hid_string_type type)
+{
+	wchar_t **string = device_info_string(info, type);
+	libusb_device **devs;
+	ssize_t num_devs, i;
+	unsigned int bus, address, interface_num;
+
+	if (!string)
+		return NULL;
+	if (*string || !info->path)
+		return *string;
+	if (hid_init() < 0)
+		return NULL;
+
+	/* Find the device from the bus and address in its path. */
+	if (sscanf(info->path, "%x:%x:%x", &bus, &address, &interface_num) != 3)
+		return NULL;
+	num_devs = libusb_get_device_list(usb_context, &devs);
+	for (i = 0; i < num_devs; i++) {
+		struct libusb_device_descriptor desc;
+		libusb_device_handle *handle;
+		uint8_t index;
+
+		if (libusb_get_bus_number(devs[i]) != bus ||
+		    libusb_get_device_address(devs[i]) != address)
+			continue;
+
+		/* Check that it's still the same device, and read the
+		   string. */
+		if (libusb_get_device_descriptor(devs[i], &desc) >= 0 &&
+		    desc.idVendor == info->vendor_id &&
+		    desc.idProduct == info->product_id) {
+			index = string_index(&desc, type);
+			if (index > 0)
+				*string = get_sysfs_usb_string(devs[i], type);
+			if (index > 0 && !*string && libusb_open(devs[i], &handle) >= 0) {
+				*string = get_usb_string(handle, index, get_language(handle));
+				libusb_close(handle);
+			}
+		}
+		break;
+	}
+	if (num_devs >= 0)
+		libusb_free_device_list(devs, 1);
+
+	return *string;
+}
+
+/* The index used by hid_open(): a device and interface, by VID, PID and
+   serial number, from the last time hid_open() found it. The index holds
+   a reference to the libusb_device, which is only listed by libusb while
+   that device is plugged in, so a stale entry is never used. */
+#define OPEN_INDEX_SIZE 64 /* A power of two */
+#define MAX_OPEN_INDEX_ENTRIES 256
+
+struct open_index_entry {
+	unsigned short vendor_id;
+	unsigned short product_id;
+	wchar_t *serial_number;
+	libusb_device *dev;
+	int interface_number;
+	struct open_index_entry *next;
+};
+
+static pthread_mutex_t open_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct open_index_entry *open_index[OPEN_INDEX_SIZE];
+static size_t num_open_index_entries = 0;
+
+static struct open_index_entry **find_open_index_entry(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct open_index_entry **entry;
+	unsigned int hash = hash_wcs(serial_number) ^ (((unsigned int) vendor_id << 16) | product_id);
+
+	entry = &open_index[hash & (OPEN_INDEX_SIZE - 1)];
+	while (*entry) {
+		if ((*entry)->vendor_id == vendor_id &&
+		    (*entry)->product_id == product_id &&
+		    wcscmp((*entry)->serial_number, serial_number) == 0)
+			break;
+		entry = &(*entry)->next;
+	}
+
+	return entry;
+}
+
+static void free_open_index_entry(struct open_index_entry *entry)
+{
+	libusb_unref_device(entry->dev);
+	free(entry->serial_number);
+	free(entry);
+}
+
+/* Drop all of the entries. This should be called with open_index_mutex
+   locked. */
+static void clear_open_index_locked(void)
+{
+	size_t i;
+
+	for (i = 0; i < OPEN_INDEX_SIZE; i++) {
+		while (open_index[i]) {
+			struct open_index_entry *next = open_index[i]->next;
+			free_open_index_entry(open_index[i]);
+			open_index[i] = next;
+		}
+	}
+	num_open_index_entries = 0;
+}
+
+static void clear_open_index(void)
+{
+	pthread_mutex_lock(&open_index_mutex);
+	clear_open_index_locked();
+	pthread_mutex_unlock(&open_index_mutex);
+}
+
+/* Returns the indexed device's path if it's still plugged in, or NULL. */
+static char *lookup_open_index(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct open_index_entry **slot, *entry;
+	libusb_device **devs;
+	ssize_t num_devs, i;
+	char *path = NULL;
+
+	pthread_mutex_lock(&open_index_mutex);
+	slot = find_open_index_entry(vendor_id, product_id, serial_number);
+	entry = *slot;
+	if (entry) {
+		num_devs = libusb_get_device_list(usb_context, &devs);
+		for (i = 0; i < num_devs; i++) {
+			if (devs[i] == entry->dev) {
+				path = make_path(entry->dev, entry->interface_number);
+				break;
+			}
+		}
+		if (num_devs >= 0)
+			libusb_free_device_list(devs, 1);
+
+		/* It's been unplugged. */
+		if (!path) {
+			*slot = entry->next;
+			free_open_index_entry(entry);
+			num_open_index_entries--;
+		}
+	}
+	pthread_mutex_unlock(&open_index_mutex);
+
+	return path;
+}
+
+static void add_open_index(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number, libusb_device *dev, int interface_number)
+{
+	struct open_index_entry **slot, *entry;
+
+	pthread_mutex_lock(&open_index_mutex);
+	slot = find_open_index_entry(vendor_id, product_id, serial_number);
+	if (*slot) {
+		entry = *slot;
+		libusb_unref_device(entry->dev);
+		entry->dev = libusb_ref_device(dev);
+		entry->interface_number = interface_number;
+	}
+	else {
+		/* Start again rather than grow without bound. */
+		if (num_open_index_entries >= MAX_OPEN_INDEX_ENTRIES) {
+			clear_open_index_locked();
+			slot = find_open_index_entry(vendor_id, product_id, serial_number);
+		}
+
+		entry = calloc(1, sizeof(struct open_index_entry));
+		if (entry) {
+			entry->vendor_id = vendor_id;
+			entry->product_id = product_id;
+			entry->serial_number = wcsdup(serial_number);
+			entry->dev = libusb_ref_device(dev);
+			entry->interface_number = interface_number;
+			*slot = entry;
+			num_open_index_entries++;
+		}
+	}
+	pthread_mutex_unlock(&open_index_mutex);
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	hid_enumeration_filter *filter;
+	hid_enumeration *enumeration;
+	const struct hid_device_info *cur_dev;
+	hid_device *handle = NULL;
+	char *path;
+
+	if(hid_init() < 0)
+		return NULL;
+
+	/* Try the device it was last time first. */
+	if (serial_number) {
+		path = lookup_open_index(vendor_id, product_id, serial_number);
+		if (path) {
+			handle = hid_open_path(path);
+			free(path);
+			if (handle)
+				return handle;
+		}
+	}
+
+	/* Stop at the first device which matches, rather than enumerating
+	   all of them. Only the serial number is read, if it's given. */
+	filter = hid_enumeration_filter_new();
+	if (!filter || hid_enumeration_filter_add_id(filter, vendor_id, product_id) < 0 ||
+	    (serial_number && hid_enumeration_filter_set_serial_number(filter, serial_number) < 0)) {
+		hid_enumeration_filter_free(filter);
+		return NULL;
 	}
 
-	hid_free_enumeration(devs);
+	enumeration = hid_enumerate_begin(filter);
+	if (enumeration) {
+		while ((cur_dev = hid_enumerate_next(enumeration)) != NULL) {
+			if (cur_dev->vendor_id == vendor_id &&
+			    cur_dev->product_id == product_id) {
+				/* Open the device */
+				handle = hid_open_path(cur_dev->path);
+				if (handle && serial_number)
+					add_open_index(vendor_id, product_id, serial_number, enumeration->dev, cur_dev->interface_number);
+				break;
+			}
+		}
+		hid_enumerate_end(enumeration);
+	}
+	hid_enumeration_filter_free(filter);
 
 	return handle;
 }
 
-static void read_callback(struct libusb_transfer *transfer)
+/* The length of each Interrupt IN transfer, which is the size of the
+   input reports. A transfer completes on a short packet or when its
+   buffer is full, so a whole number of packets no shorter than the
+   longest Input report gets one report per transfer, however many
+   packets it spans, without overflowing on a full last packet. When the
+   report descriptor isn't known, one microframe's worth is read, which
+   is more than one packet on a high-bandwidth endpoint. */
+static size_t get_input_transfer_size(const hid_device *dev)
+{
+	size_t packet_size = dev->input_ep_max_packet_size;
+	size_t size;
+
+	if (packet_size == 0)
+		return 1;
+
+	if (dev->max_input_report_size > 0)
+		size = (dev->max_input_report_size + packet_size - 1) / packet_size * packet_size;
+	else
+		size = packet_size * dev->input_ep_transactions;
+
+	if (size > MAX_INPUT_TRANSFER_SIZE)
+		size = MAX_INPUT_TRANSFER_SIZE / packet_size * packet_size;
+	return size;
+}
+
+/* Allocate the input reports. Their data is one block, either given in
+   options or allocated here. */
+static int alloc_input_reports(hid_device *dev, const struct hid_open_options *options)
+{
+	/* Every report but the ones being read into can be queued, except
+	   with HID_OVERFLOW_BLOCK, which stops reading when they're all
+	   queued. */
+	int block = (options->overflow_policy == HID_OVERFLOW_BLOCK);
+	unsigned int num_transfers = options->num_transfers;
+	unsigned int spare;
+	unsigned int num_reports, ring_size, i;
+	unsigned char *memory;
+
+	if (num_transfers == 0)
+		num_transfers = DEFAULT_NUM_TRANSFERS;
+	spare = block? 0: num_transfers;
+
+	dev->report_size = get_input_transfer_size(dev);
+
+	if (options->report_memory) {
+		num_reports = options->report_memory_size / dev->report_size;
+		if (num_reports < (block? 1u: 2u)) {
+			LOG("report_memory is too small for %d byte reports\n", (int) dev->report_size);
+			return -1;
+		}
+		/* Leave room to queue at least one. */
+		if (!block && spare >= num_reports)
+			spare = num_transfers = num_reports - 1;
+		memory = options->report_memory;
+	}
+	else {
+		num_reports = options->input_queue_depth;
+		if (num_reports == 0)
+			num_reports = DEFAULT_INPUT_QUEUE_DEPTH;
+		num_reports += spare;
+		memory = dev->report_memory = malloc((size_t) num_reports * dev->report_size);
+		if (!memory)
+			return -1;
+	}
+	dev->input_queue_depth = num_reports - spare;
+
+	dev->report_pool = calloc(num_reports, sizeof(struct input_report));
+	if (!dev->report_pool)
+		return -1;
+	for (i = 0; i < num_reports; i++) {
+		dev->report_pool[i].data = memory + (size_t) i * dev->report_size;
+		dev->report_pool[i].next = dev->free_reports;
+		dev->free_reports = &dev->report_pool[i];
+	}
+
+	/* The queue can hold every report. */
+	ring_size = 1;
+	while (ring_size < num_reports)
+		ring_size *= 2;
+	dev->input_reports = calloc(ring_size, sizeof(struct input_report *));
+	if (!dev->input_reports)
+		return -1;
+	dev->input_reports_mask = ring_size - 1;
+
+	/* The transfers each take a report to read into. With
+	   HID_OVERFLOW_BLOCK, the ones which don't get one are held to begin
+	   with. */
+	dev->transfers = calloc(num_transfers, sizeof(struct read_transfer));
+	if (!dev->transfers)
+		return -1;
+	dev->num_transfers = num_transfers;
+	for (i = 0; i < num_transfers; i++) {
+		struct read_transfer *rt = &dev->transfers[i];
+
+		rt->dev = dev;
+		rt->transfer = libusb_alloc_transfer(0);
+		if (!rt->transfer)
+			return -1;
+		if (dev->free_reports) {
+			rt->report = dev->free_reports;
+			dev->free_reports = dev->free_reports->next;
+		}
+		else {
+			dev->num_held_transfers++;
+		}
+		libusb_fill_interrupt_transfer(rt->transfer,
+			dev->device_handle,
+			dev->input_endpoint,
+			rt->report? rt->report->data: NULL,
+			dev->report_size,
+			read_callback,
+			rt,
+			5000/*timeout*/);
+	}
+
+	return 0;
+}
+
+/* Add rpt to the end of the queue. This should be called with
+   dev->mutex locked. */
+static void queue_input_report(hid_device *dev, struct input_report *rpt)
+{
+	dev->input_reports[(dev->input_reports_head + dev->num_input_reports) & dev->input_reports_mask] = rpt;
+	dev->num_input_reports++;
+	if (dev->num_input_reports == 1) {
+		/* The queue was empty. Readers are signaled by
+		   read_callback(). */
+		dev->signal_readers = 1;
+		set_pollable(dev);
+	}
+}
+
+/* Take the first report off the queue. This should be called with
+   dev->mutex locked, and a report queued. */
+static struct input_report *dequeue_input_report(hid_device *dev)
+{
+	struct input_report *rpt = dev->input_reports[dev->input_reports_head];
+
+	dev->input_reports_head = (dev->input_reports_head + 1) & dev->input_reports_mask;
+	dev->num_input_reports--;
+
+	/* Once the device is gone, the fd stays readable for good. */
+	if (!dev->num_input_reports && !dev->shutdown_thread)
+		clear_pollable(dev);
+
+	return rpt;
+}
+
+/* Note that reading has stopped, now that none of the transfers are
+   submitted after shutdown_thread is set. Without a read_thread() to
+   finish up, this wakes any threads which are waiting on data. This
+   should be called with dev->mutex locked. */
+static void stop_reading(hid_device *dev)
+{
+	__atomic_store_n(&dev->cancelled, 1, __ATOMIC_RELEASE);
+	if (dev->has_read_thread)
+		return;
+
+	pthread_cond_broadcast(&dev->condition);
+	if (!dev->num_input_reports)
+		set_pollable(dev);
+	mark_ready(dev);
+}
+
+/* Submit rt, to read into its report. This should be called with
+   dev->mutex locked. */
+static void submit_read_transfer(hid_device *dev, struct read_transfer *rt)
 {
-	hid_device *dev = transfer->user_data;
 	int res;
 
-	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+	rt->transfer->buffer = rt->report->data;
+	res = libusb_submit_transfer(rt->transfer);
+	if (res != 0) {
+		LOG("Unable to submit URB. libusb error code: %d\n", res);
+		__atomic_store_n(&dev->shutdown_thread, 1, __ATOMIC_RELEASE);
+		if (dev->num_submitted_transfers == 0)
+			stop_reading(dev);
+		return;
+	}
+	dev->num_submitted_transfers++;
+}
 
-		struct input_report *rpt = malloc(sizeof(*rpt));
-		rpt->data = malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
+/* Resubmit held transfers, in turn, while there are free reports for them
+   to read into. This should be called with dev->mutex locked. */
+static void resubmit_held_transfers(hid_device *dev)
+{
+	while (dev->num_held_transfers > 0 && dev->free_reports &&
+	       !dev->shutdown_thread) {
+		struct read_transfer *rt = &dev->transfers[
+			(dev->next_transfer + dev->num_transfers - dev->num_held_transfers) % dev->num_transfers];
+
+		rt->report = dev->free_reports;
+		dev->free_reports = dev->free_reports->next;
+		dev->num_held_transfers--;
+		submit_read_transfer(dev, rt);
+
+		/* Let read_thread() handle events again. */
+		pthread_cond_signal(&dev->space_condition);
+	}
+}
 
-		pthread_mutex_lock(&dev->mutex);
+/* Put rpt on the free list. This should be called with dev->mutex
+   locked. */
+static void free_input_report(hid_device *dev, struct input_report *rpt)
+{
+	rpt->next = dev->free_reports;
+	dev->free_reports = rpt;
 
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			pthread_cond_signal(&dev->condition);
+	/* Resume reading, if it was stopped for want of a report. */
+	resubmit_held_transfers(dev);
+}
+
+/* Handle a transfer which has completed, in the order that they were
+   submitted, and resubmit it. This should be called with dev->mutex
+   locked. */
+static void handle_read_transfer(hid_device *dev, struct read_transfer *rt)
+{
+	struct libusb_transfer *transfer = rt->transfer;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		/* The transfer read straight into rt->report. Queue it, and
+		   find another report to read the next one into. */
+		struct input_report *rpt = rt->report;
+
+		dev->reports_received++;
+
+		if (!dev->free_reports &&
+		    dev->overflow_policy == HID_OVERFLOW_DROP_NEWEST) {
+			/* Read the next one over this one. */
+			dev->reports_dropped++;
 		}
 		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
+			queue_input_report(dev, rpt);
+
+			if (dev->num_held_transfers > 0 ||
+			    (!dev->free_reports && dev->overflow_policy == HID_OVERFLOW_BLOCK)) {
+				/* Stop reading. The transfers are resubmitted
+				   in turn as reports are freed, see
+				   free_input_report(). */
+				rt->report = NULL;
+				dev->num_held_transfers++;
 			}
-			cur->next = rpt;
-
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
+			else if (dev->free_reports) {
+				rt->report = dev->free_reports;
+				dev->free_reports = dev->free_reports->next;
 			}
+			else {
+				/* Drop the oldest report. This way we don't grow
+				   forever if the user never reads anything from
+				   the device. If everything else is lent out,
+				   that's the one which just arrived. */
+				rt->report = dequeue_input_report(dev);
+				dev->reports_dropped++;
+			}
+
+			if (dev->num_input_reports)
+				mark_ready(dev);
 		}
-		pthread_mutex_unlock(&dev->mutex);
+		if (!rt->report)
+			return;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
-		return;
+		__atomic_store_n(&dev->shutdown_thread, 1, __ATOMIC_RELEASE);
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
-		return;
+		__atomic_store_n(&dev->shutdown_thread, 1, __ATOMIC_RELEASE);
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
 		//LOG("Timeout (normal)\n");
@@ -786,44 +2848,116 @@ static void read_callback(struct libusb_transfer *transfer)
 		LOG("Unknown transfer code: %d\n", transfer->status);
 	}
 
-	/* Re-submit the transfer object. */
-	res = libusb_submit_transfer(transfer);
-	if (res != 0) {
-		LOG("Unable to submit URB. libusb error code: %d\n", res);
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+	if (dev->shutdown_thread)
+		return;
+
+	/* Re-submit the transfer object, after any which are held. */
+	if (dev->num_held_transfers > 0) {
+		struct input_report *rpt = rt->report;
+		rt->report = NULL;
+		dev->num_held_transfers++;
+		free_input_report(dev, rpt);
+	}
+	else {
+		submit_read_transfer(dev, rt);
+	}
+}
+
+/* Cancel all of the pending transfers. This call will fail for those
+   which aren't pending, but that's OK. */
+static void cancel_read_transfers(hid_device *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->num_transfers; i++)
+		libusb_cancel_transfer(dev->transfers[i].transfer);
+}
+
+static void read_callback(struct libusb_transfer *transfer)
+{
+	struct read_transfer *rt = transfer->user_data;
+	hid_device *dev = rt->dev;
+	int signal_readers;
+
+	/* hid_close() doesn't free dev until this returns. */
+	__atomic_add_fetch(&dev->running_callbacks, 1, __ATOMIC_ACQUIRE);
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		rt->report->len = transfer->actual_length;
+		rt->report->timestamp = get_timestamp();
 	}
+
+	pthread_mutex_lock(&dev->mutex);
+	rt->done = 1;
+	dev->num_submitted_transfers--;
+
+	/* Transfers are handled in the order of the ring, which is the
+	   order they're submitted in, so that reports stay in order. libusb
+	   completes them in that order anyway, but that's not promised. */
+	while (dev->transfers[dev->next_transfer].done) {
+		rt = &dev->transfers[dev->next_transfer];
+		rt->done = 0;
+		dev->next_transfer = (dev->next_transfer + 1) % dev->num_transfers;
+		handle_read_transfer(dev, rt);
+	}
+
+	if (dev->shutdown_thread && !dev->cancelled) {
+		if (dev->num_submitted_transfers == 0)
+			stop_reading(dev);
+		else if (!dev->has_read_thread)
+			/* The device has gone. Stop the others too. */
+			cancel_read_transfers(dev);
+	}
+
+	/* Wake a reader if the queue was empty. That's done once the mutex
+	   is unlocked, so that the reader doesn't wake up only to wait for
+	   it. */
+	signal_readers = dev->signal_readers;
+	dev->signal_readers = 0;
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (signal_readers)
+		pthread_cond_signal(&dev->condition);
+	__atomic_sub_fetch(&dev->running_callbacks, 1, __ATOMIC_RELEASE);
 }
 
+/* Make the first submissions, in turn, of the transfers which have
+   reports to read into. Further submissions are made from inside
+   read_callback(). */
+static void start_reading(hid_device *dev)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&dev->mutex);
+	for (i = 0; i < dev->num_transfers - dev->num_held_transfers; i++)
+		submit_read_transfer(dev, &dev->transfers[i]);
+	pthread_mutex_unlock(&dev->mutex);
+}
 
 static void *read_thread(void *param)
 {
 	hid_device *dev = param;
-	unsigned char *buf;
-	const size_t length = dev->input_ep_max_packet_size;
-
-	/* Set up the transfer object. */
-	buf = malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
-		dev->device_handle,
-		dev->input_endpoint,
-		buf,
-		length,
-		read_callback,
-		dev,
-		5000/*timeout*/);
-
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
+
+	start_reading(dev);
 
 	/* Notify the main thread that the read thread is up and running. */
 	pthread_barrier_wait(&dev->barrier);
 
 	/* Handle all the events. */
-	while (!dev->shutdown_thread) {
-		int res;
+	while (!__atomic_load_n(&dev->shutdown_thread, __ATOMIC_ACQUIRE)) {
+		int res, held;
+
+		/* HID_OVERFLOW_BLOCK: if every transfer is held, wait for a
+		   report to be freed, and a transfer resubmitted to read into
+		   it. */
+		pthread_mutex_lock(&dev->mutex);
+		held = (dev->num_submitted_transfers == 0);
+		while (dev->num_submitted_transfers == 0 && !dev->shutdown_thread)
+			pthread_cond_wait(&dev->space_condition, &dev->mutex);
+		pthread_mutex_unlock(&dev->mutex);
+		if (held)
+			continue;
+
 		res = libusb_handle_events(usb_context);
 		if (res < 0) {
 			/* There was an error. */
@@ -839,11 +2973,16 @@ static void *read_thread(void *param)
 		}
 	}
 
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	libusb_cancel_transfer(dev->transfer);
+	/* Held transfers aren't pending, so there's nothing to cancel. */
+	pthread_mutex_lock(&dev->mutex);
+	__atomic_store_n(&dev->shutdown_thread, 1, __ATOMIC_RELEASE);
+	if (dev->num_submitted_transfers == 0)
+		stop_reading(dev);
+	pthread_mutex_unlock(&dev->mutex);
 
-	while (!dev->cancelled)
+	cancel_read_transfers(dev);
+
+	while (!__atomic_load_n(&dev->cancelled, __ATOMIC_ACQUIRE))
 		libusb_handle_events_completed(usb_context, &dev->cancelled);
 
 	/* Now that the read thread is stopping, Wake any threads which are
@@ -853,23 +2992,114 @@ static void *read_thread(void *param)
 	   signaled. */
 	pthread_mutex_lock(&dev->mutex);
 	pthread_cond_broadcast(&dev->condition);
+	if (!dev->num_input_reports)
+		set_pollable(dev);
+	mark_ready(dev);
 	pthread_mutex_unlock(&dev->mutex);
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
+	/* The transfer objects are cleaned up
 	   in hid_close(). They are not cleaned up here because this thread
 	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
+	   call to hid_close(). In both cases they can be safely
 	   cleaned up after the call to pthread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
+	   since hid_close() calls libusb_cancel_transfer() on them,
 	   they can not be cleaned up here. */
 
 	return NULL;
 }
 
+static void *event_thread_main(void *param)
+{
+	/* Wake up now and then to check event_thread_stop, in case
+	   libusb_interrupt_event_handler() isn't there. */
+	struct timeval tv = { 1, 0 };
+	int res;
+
+	while (!__atomic_load_n(&event_thread_stop, __ATOMIC_ACQUIRE)) {
+		res = libusb_handle_events_timeout_completed(usb_context, &tv, &event_thread_stop);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED)
+			LOG("event_thread_main(): libusb reports error # %d\n", res);
+	}
+
+	return NULL;
+}
+
+/* Start the shared event thread, if it isn't running. */
+static int start_event_thread(void)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&event_thread_mutex);
+	if (!event_thread_running) {
+		event_thread_stop = 0;
+		if (pthread_create(&event_thread, NULL, event_thread_main, NULL) == 0)
+			event_thread_running = 1;
+		else
+			res = -1;
+	}
+	pthread_mutex_unlock(&event_thread_mutex);
+
+	return res;
+}
+
+static void stop_event_thread(void)
+{
+	pthread_mutex_lock(&event_thread_mutex);
+	if (event_thread_running) {
+		__atomic_store_n(&event_thread_stop, 1, __ATOMIC_RELEASE);
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+		libusb_interrupt_event_handler(usb_context);
+#endif
+		pthread_join(event_thread, NULL);
+		event_thread_running = 0;
+	}
+	pthread_mutex_unlock(&event_thread_mutex);
+}
+
+
+/* Copy the fields of src which lie within the first size bytes of a
+   struct hid_open_options to dst. */
+static void copy_open_options(struct hid_open_options *dst, const struct hid_open_options *src, size_t size)
+{
+#define COPY_OPTION(field) \
+	if (size >= offsetof(struct hid_open_options, field) + sizeof(src->field)) \
+		dst->field = src->field
+
+	COPY_OPTION(input_queue_depth);
+	COPY_OPTION(overflow_policy);
+	COPY_OPTION(background_reader);
+	COPY_OPTION(report_memory);
+	COPY_OPTION(report_memory_size);
+	COPY_OPTION(num_transfers);
+#undef COPY_OPTION
+}
+
+void HID_API_EXPORT hid_open_options_init(struct hid_open_options *options, size_t size)
+{
+	struct hid_open_options defaults;
+
+	memset(&defaults, 0, sizeof(defaults));
+	defaults.input_queue_depth = DEFAULT_INPUT_QUEUE_DEPTH;
+	defaults.overflow_policy = HID_OVERFLOW_DROP_OLDEST;
+	defaults.background_reader = 0;
+	defaults.num_transfers = DEFAULT_NUM_TRANSFERS;
+
+	/* The caller's struct may be older, and so shorter, than ours. */
+	memset(options, 0, size);
+	copy_open_options(options, &defaults, size);
+	if (size >= sizeof(options->size))
+		options->size = size;
+}
 
 hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	return hid_open_path_ex(path, NULL);
+}
+
+hid_device * HID_API_EXPORT hid_open_path_ex(const char *path, const struct hid_open_options *options)
 {
 	hid_device *dev = NULL;
+	struct hid_open_options caller_options;
 
 	libusb_device **devs;
 	libusb_device *usb_dev;
@@ -880,7 +3110,25 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	if(hid_init() < 0)
 		return NULL;
 
+	/* background_reader is ignored. Input always arrives in the
+	   background anyway: on the device's read_thread(), or on the
+	   shared event thread with HID_INIT_SHARED_EVENT_THREAD. */
+	/* Take the fields which the caller has, and the defaults for the
+	   rest. */
+	hid_open_options_init(&caller_options, sizeof(caller_options));
+	if (options) {
+		if (options->size < sizeof(options->size)) {
+			LOG("hid_open_path_ex(): options weren't initialized\n");
+			return NULL;
+		}
+		copy_open_options(&caller_options, options, options->size);
+	}
+	options = &caller_options;
+
 	dev = new_hid_device();
+	if (!dev)
+		return NULL;
+	dev->overflow_policy = options->overflow_policy;
 
 	libusb_get_device_list(usb_context, &devs);
 	while ((usb_dev = devs[d++]) != NULL) {
@@ -899,8 +3147,19 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
 					char *dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber);
 					if (!strcmp(dev_path, path)) {
+						struct report_descriptor_info descriptor_info;
+						int have_descriptor_info;
+
 						/* Matched Paths. Open this device */
 
+						/* The report descriptor can be read from
+						   sysfs only before the kernel driver is
+						   detached. */
+						have_descriptor_info =
+							lookup_descriptor_cache(&desc, intf_desc->bInterfaceNumber, &descriptor_info) == 0 ||
+							cache_sysfs_report_descriptor(usb_dev, &desc, conf_desc->bConfigurationValue,
+							                              intf_desc->bInterfaceNumber, &descriptor_info) == 0;
+
 						/* OPEN HERE */
 						res = libusb_open(usb_dev, &dev->device_handle);
 						if (res < 0) {
@@ -940,6 +3199,15 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 						/* Store off the interface number */
 						dev->interface = intf_desc->bInterfaceNumber;
 
+						/* Otherwise, now that the interface is
+						   claimed, its report descriptor can be read,
+						   and cached for hid_enumerate() to find while
+						   the kernel driver is detached. */
+						if (!have_descriptor_info)
+							have_descriptor_info = cache_device_report_descriptor(dev->device_handle, &desc, dev->interface, &descriptor_info) == 0;
+						if (have_descriptor_info)
+							dev->max_input_report_size = descriptor_info.max_input_report_size;
+
 						/* Find the INPUT and OUTPUT endpoints. An
 						   OUTPUT endpoint is not required. */
 						for (i = 0; i < intf_desc->bNumEndpoints; i++) {
@@ -963,7 +3231,15 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							    is_interrupt && is_input) {
 								/* Use this endpoint for INPUT */
 								dev->input_endpoint = ep->bEndpointAddress;
-								dev->input_ep_max_packet_size = ep->wMaxPacketSize;
+								/* Bits 12..11 of wMaxPacketSize are
+								   the number of additional transactions
+								   per microframe of a high-bandwidth
+								   endpoint, see section 9.6.6 of the
+								   USB 2.0 specification. */
+								dev->input_ep_max_packet_size = ep->wMaxPacketSize & 0x7ff;
+								dev->input_ep_transactions = ((ep->wMaxPacketSize >> 11) & 0x3) + 1;
+								if (dev->input_ep_transactions > 3)
+									dev->input_ep_transactions = 3; /* reserved */
 							}
 							if (dev->output_endpoint == 0 &&
 							    is_interrupt && is_output) {
@@ -972,10 +3248,33 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							}
 						}
 
-						pthread_create(&dev->thread, NULL, read_thread, dev);
+						if (alloc_input_reports(dev, options) < 0) {
+							libusb_release_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+							libusb_close(dev->device_handle);
+							free(dev_path);
+							good_open = 0;
+							break;
+						}
+
+						if (shared_event_thread) {
+							/* The shared event thread handles
+							   the transfers. */
+							if (start_event_thread() < 0) {
+								libusb_release_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+								libusb_close(dev->device_handle);
+								free(dev_path);
+								good_open = 0;
+								break;
+							}
+							start_reading(dev);
+						}
+						else {
+							dev->has_read_thread = 1;
+							pthread_create(&dev->thread, NULL, read_thread, dev);
 
-						/* Wait here for the read thread to be initialized. */
-						pthread_barrier_wait(&dev->barrier);
+							/* Wait here for the read thread to be initialized. */
+							pthread_barrier_wait(&dev->barrier);
+						}
 
 					}
 					free(dev_path);
@@ -1052,17 +3351,18 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 
 /* Helper function, to simplify hid_read().
    This should be called with dev->mutex locked. */
-static int return_data(hid_device *dev, unsigned char *data, size_t length)
+static int return_data(hid_device *dev, unsigned char *data, size_t length, struct hid_report_info *info)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
+	/* Copy the data out of the first queued report (rpt) into the
+	   return buffer (data), and free the report. */
+	struct input_report *rpt = dequeue_input_report(dev);
 	size_t len = (length < rpt->len)? length: rpt->len;
 	if (len > 0)
 		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
+	if (info)
+		info->timestamp = rpt->timestamp;
+	free_input_report(dev, rpt);
+
 	return len;
 }
 
@@ -1073,91 +3373,200 @@ static void cleanup_mutex(void *param)
 }
 
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+/* Compute the absolute time, for pthread_cond_timedwait(), at which a
+   timeout of milliseconds expires. */
+static void get_abs_timeout(int milliseconds, struct timespec *ts)
 {
-	int bytes_read = -1;
-
-#if 0
-	int transferred;
-	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
-	LOG("transferred: %d\n", transferred);
-	return transferred;
-#endif
-
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cleanup_push(&cleanup_mutex, dev);
-
-	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
-		goto ret;
+	clock_gettime(CONDITION_CLOCK, ts);
+	ts->tv_sec += milliseconds / 1000;
+	ts->tv_nsec += (milliseconds % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
 	}
+}
+
+/* Wait for an input report to be queued by read_callback(). This should
+   be called with dev->mutex locked. Returns 1 if a report is queued, 0 if
+   the timeout expired, and -1 on error or if the device was
+   disconnected. */
+static int wait_for_input_reports(hid_device *dev, int milliseconds)
+{
+	/* There's an input report queued up. */
+	if (dev->num_input_reports)
+		return 1;
 
 	if (dev->shutdown_thread) {
 		/* This means the device has been disconnected.
 		   An error code of -1 should be returned. */
-		bytes_read = -1;
-		goto ret;
+		return -1;
 	}
 
 	if (milliseconds == -1) {
 		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!dev->num_input_reports && !dev->shutdown_thread) {
 			pthread_cond_wait(&dev->condition, &dev->mutex);
 		}
-		if (dev->input_reports) {
-			bytes_read = return_data(dev, data, length);
-		}
+		return (dev->num_input_reports)? 1: -1;
 	}
 	else if (milliseconds > 0) {
 		/* Non-blocking, but called with timeout. */
 		int res;
 		struct timespec ts;
-		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += milliseconds / 1000;
-		ts.tv_nsec += (milliseconds % 1000) * 1000000;
-		if (ts.tv_nsec >= 1000000000L) {
-			ts.tv_sec++;
-			ts.tv_nsec -= 1000000000L;
-		}
+		get_abs_timeout(milliseconds, &ts);
 
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!dev->num_input_reports && !dev->shutdown_thread) {
 			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
-			if (res == 0) {
-				if (dev->input_reports) {
-					bytes_read = return_data(dev, data, length);
-					break;
-				}
-
-				/* If we're here, there was a spurious wake up
-				   or the read thread was shutdown. Run the
-				   loop again (ie: don't break). */
-			}
-			else if (res == ETIMEDOUT) {
+			if (res == ETIMEDOUT) {
 				/* Timed out. */
-				bytes_read = 0;
-				break;
+				return 0;
 			}
-			else {
+			else if (res != 0) {
 				/* Error. */
-				bytes_read = -1;
-				break;
+				return -1;
 			}
+
+			/* If we're here, there was a spurious wake up, a report
+			   arrived, or the read thread was shutdown. Let the
+			   loop condition sort it out. */
 		}
+		return (dev->num_input_reports)? 1: -1;
 	}
-	else {
-		/* Purely non-blocking */
-		bytes_read = 0;
+
+	/* Purely non-blocking */
+	return 0;
+}
+
+int HID_API_EXPORT hid_read_ex(hid_device *dev, unsigned char *data, size_t length, struct hid_report_info *info, int milliseconds)
+{
+	int bytes_read = -1;
+
+#if 0
+	int transferred;
+	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
+	LOG("transferred: %d\n", transferred);
+	return transferred;
+#endif
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	bytes_read = wait_for_input_reports(dev, milliseconds);
+	if (bytes_read > 0) {
+		/* Return the first one */
+		bytes_read = return_data(dev, data, length, info);
+
+		/* Still ready if there are more. */
+		if (dev->num_input_reports)
+			mark_ready(dev);
 	}
 
-ret:
 	pthread_mutex_unlock(&dev->mutex);
 	pthread_cleanup_pop(0);
 
 	return bytes_read;
 }
 
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	return hid_read_ex(dev, data, length, NULL, milliseconds);
+}
+
+int HID_API_EXPORT hid_read_many(hid_device *dev, unsigned char **data, size_t *lengths, size_t max_reports, int milliseconds)
+{
+	int res;
+	size_t i = 0;
+
+	if (max_reports == 0)
+		return 0;
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	res = wait_for_input_reports(dev, milliseconds);
+	if (res > 0) {
+		/* Pop everything that's queued, under this one lock. */
+		while (dev->num_input_reports && i < max_reports) {
+			lengths[i] = return_data(dev, data[i], lengths[i], NULL);
+			i++;
+		}
+		res = i;
+
+		/* Still ready if there are more. */
+		if (dev->num_input_reports)
+			mark_ready(dev);
+	}
+
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	return res;
+}
+
+int HID_API_EXPORT hid_read_borrow(hid_device *dev, struct hid_report_lease *lease, int milliseconds)
+{
+	int res;
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	res = wait_for_input_reports(dev, milliseconds);
+	if (res > 0) {
+		struct input_report *rpt = dequeue_input_report(dev);
+		res = rpt->len;
+		if (res > 0) {
+			lease->data = rpt->data;
+			lease->length = rpt->len;
+			lease->timestamp = rpt->timestamp;
+			lease->slot = rpt;
+			dev->num_leased_reports++;
+		}
+		else {
+			/* Nothing to lend out */
+			free_input_report(dev, rpt);
+		}
+
+		/* Still ready if there are more. */
+		if (dev->num_input_reports)
+			mark_ready(dev);
+	}
+
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	return res;
+}
+
+int HID_API_EXPORT hid_read_release(hid_device *dev, struct hid_report_lease *lease)
+{
+	struct input_report *rpt = lease->slot;
+
+	if (!rpt)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->num_leased_reports--;
+	free_input_report(dev, rpt);
+	pthread_mutex_unlock(&dev->mutex);
+
+	lease->slot = NULL;
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_queue_stats(hid_device *dev, struct hid_queue_stats *stats)
+{
+	pthread_mutex_lock(&dev->mutex);
+	stats->reports_received = dev->reports_received;
+	stats->reports_dropped = dev->reports_dropped;
+	stats->reports_queued = dev->num_input_reports;
+	stats->reports_leased = dev->num_leased_reports;
+	stats->queue_depth = dev->input_queue_depth;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
 int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 {
 	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
@@ -1237,16 +3646,30 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
-	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	if (dev->set)
+		hid_device_set_remove(dev);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+	/* Cause read_thread() to stop. */
+	pthread_mutex_lock(&dev->mutex);
+	__atomic_store_n(&dev->shutdown_thread, 1, __ATOMIC_RELEASE);
+	if (!dev->has_read_thread && dev->num_submitted_transfers == 0)
+		__atomic_store_n(&dev->cancelled, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&dev->space_condition);
+	pthread_mutex_unlock(&dev->mutex);
+	cancel_read_transfers(dev);
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+	if (dev->has_read_thread) {
+		/* Wait for read_thread() to end. */
+		pthread_join(dev->thread, NULL);
+	}
+	else {
+		/* Wait for the shared event thread to see the transfers
+		   cancelled. */
+		pthread_mutex_lock(&dev->mutex);
+		while (!dev->cancelled)
+			pthread_cond_wait(&dev->condition, &dev->mutex);
+		pthread_mutex_unlock(&dev->mutex);
+	}
 
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1254,51 +3677,327 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
+	/* The last callback may still be on its way out. */
+	while (__atomic_load_n(&dev->running_callbacks, __ATOMIC_ACQUIRE))
+		sched_yield();
 
+	/* The transfers and input reports are freed with the device. */
 	free_hid_device(dev);
 }
 
 
+/* Copy dev's string string_index into string. The first time it's asked
+   for, it's read, from sysfs if it's the string of type (an enum
+   hid_string_type, or -1) and the kernel has read it (on Linux), or else
+   from the device. Strings don't change while a device is open, so it's
+   kept for next time, as is the language which they're read in. */
+static int get_cached_string(hid_device *dev, int string_index, int type, wchar_t *string, size_t maxlen)
+{
+	struct cached_string *cached;
+	wchar_t *str = NULL;
+
+	pthread_mutex_lock(&dev->strings_mutex);
+	for (cached = dev->strings; cached; cached = cached->next) {
+		if (cached->index == string_index)
+			break;
+	}
+
+	if (!cached) {
+		if (type >= 0 && string_index > 0)
+			str = get_sysfs_usb_string(libusb_get_device(dev->device_handle), (enum hid_string_type) type);
+		if (!str) {
+			if (!dev->have_language) {
+				dev->language = get_language(dev->device_handle);
+				dev->have_language = 1;
+			}
+			str = get_usb_string(dev->device_handle, string_index, dev->language);
+		}
+
+		/* Failures aren't kept, so they're tried again. */
+		if (str) {
+			cached = malloc(sizeof(struct cached_string));
+			if (cached) {
+				cached->index = string_index;
+				cached->string = str;
+				cached->next = dev->strings;
+				dev->strings = cached;
+			}
+		}
+	}
+
+	if (cached) {
+		wcsncpy(string, cached->string, maxlen);
+		string[maxlen-1] = L'\0';
+	}
+	else if (str) {
+		/* It couldn't be kept. */
+		wcsncpy(string, str, maxlen);
+		string[maxlen-1] = L'\0';
+		free(str);
+	}
+	pthread_mutex_unlock(&dev->strings_mutex);
+
+	return (cached || str)? 0: -1;
+}
+
 int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
-	return hid_get_indexed_string(dev, dev->manufacturer_index, string, maxlen);
+	return get_cached_string(dev, dev->manufacturer_index, HID_STRING_MANUFACTURER, string, maxlen);
 }
 
 int HID_API_EXPORT_CALL hid_get_product_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
-	return hid_get_indexed_string(dev, dev->product_index, string, maxlen);
+	return get_cached_string(dev, dev->product_index, HID_STRING_PRODUCT, string, maxlen);
 }
 
 int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
-	return hid_get_indexed_string(dev, dev->serial_index, string, maxlen);
+	return get_cached_string(dev, dev->serial_index, HID_STRING_SERIAL_NUMBER, string, maxlen);
 }
 
 int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
 {
-	wchar_t *str;
+	return get_cached_string(dev, string_index, -1, string, maxlen);
+}
 
-	str = get_usb_string(dev->device_handle, string_index);
-	if (str) {
-		wcsncpy(string, str, maxlen);
-		string[maxlen-1] = L'\0';
-		free(str);
-		return 0;
+
+HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
+{
+	return NULL;
+}
+
+
+/* The io_uring engine is hidraw only. */
+hid_uring * HID_API_EXPORT hid_uring_new(unsigned int queue_depth)
+{
+	return NULL;
+}
+
+void HID_API_EXPORT hid_uring_free(hid_uring *ring)
+{
+}
+
+int HID_API_EXPORT hid_uring_add_device(hid_uring *ring, hid_device *dev)
+{
+	return -1;
+}
+
+int HID_API_EXPORT hid_uring_remove_device(hid_device *dev)
+{
+	return -1;
+}
+
+int HID_API_EXPORT hid_uring_write(hid_device *dev, const unsigned char *data, size_t length, void *user_data)
+{
+	return -1;
+}
+
+int HID_API_EXPORT hid_uring_send_feature_report(hid_device *dev, const unsigned char *data, size_t length, void *user_data)
+{
+	return -1;
+}
+
+int HID_API_EXPORT hid_uring_get_feature_report(hid_device *dev, unsigned char *data, size_t length, void *user_data)
+{
+	return -1;
+}
+
+int HID_API_EXPORT hid_uring_wait(hid_uring *ring, struct hid_uring_completion *completions, size_t max_completions, int milliseconds)
+{
+	return -1;
+}
+
+
+int HID_API_EXPORT hid_get_pollable_fd(hid_device *dev)
+{
+	return dev->pollable_fd;
+}
+
+
+/* Put dev on its set's ready list, so that hid_wait_set() returns it.
+   This should be called with dev->mutex locked. */
+static void mark_ready(hid_device *dev)
+{
+	hid_device_set *set = dev->set;
+
+	if (!set)
+		return;
+
+	pthread_mutex_lock(&set->mutex);
+	if (!dev->set_ready) {
+		dev->set_ready = 1;
+		dev->ready_next = NULL;
+		if (set->ready_tail)
+			set->ready_tail->ready_next = dev;
+		else
+			set->ready_head = dev;
+		set->ready_tail = dev;
+		pthread_cond_signal(&set->condition);
 	}
-	else
+	pthread_mutex_unlock(&set->mutex);
+}
+
+static void cleanup_set_mutex(void *param)
+{
+	hid_device_set *set = param;
+	pthread_mutex_unlock(&set->mutex);
+}
+
+hid_device_set * HID_API_EXPORT hid_device_set_new(void)
+{
+	hid_device_set *set = calloc(1, sizeof(hid_device_set));
+	if (!set)
+		return NULL;
+
+	pthread_mutex_init(&set->mutex, NULL);
+	init_timed_condition(&set->condition);
+
+	return set;
+}
+
+void HID_API_EXPORT hid_device_set_free(hid_device_set *set)
+{
+	if (!set)
+		return;
+
+	while (set->members)
+		hid_device_set_remove(set->members);
+
+	pthread_cond_destroy(&set->condition);
+	pthread_mutex_destroy(&set->mutex);
+	free(set);
+}
+
+int HID_API_EXPORT hid_device_set_add(hid_device_set *set, hid_device *dev)
+{
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->set) {
+		pthread_mutex_unlock(&dev->mutex);
 		return -1;
+	}
+	dev->set = set;
+
+	pthread_mutex_lock(&set->mutex);
+	dev->set_prev = NULL;
+	dev->set_next = set->members;
+	if (set->members)
+		set->members->set_prev = dev;
+	set->members = dev;
+	pthread_mutex_unlock(&set->mutex);
+
+	/* It may be ready already. */
+	if (dev->num_input_reports || dev->shutdown_thread)
+		mark_ready(dev);
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
 }
 
+int HID_API_EXPORT hid_device_set_remove(hid_device *dev)
+{
+	hid_device_set *set;
+
+	/* Once dev->set is cleared, read_callback() can't put the device
+	   on the ready list any more. */
+	pthread_mutex_lock(&dev->mutex);
+	set = dev->set;
+	dev->set = NULL;
+	pthread_mutex_unlock(&dev->mutex);
 
-HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
+	if (!set)
+		return -1;
+
+	pthread_mutex_lock(&set->mutex);
+	if (dev->set_prev)
+		dev->set_prev->set_next = dev->set_next;
+	else
+		set->members = dev->set_next;
+	if (dev->set_next)
+		dev->set_next->set_prev = dev->set_prev;
+
+	if (dev->set_ready) {
+		hid_device *cur = set->ready_head, *prev = NULL;
+		while (cur != dev) {
+			prev = cur;
+			cur = cur->ready_next;
+		}
+		if (prev)
+			prev->ready_next = dev->ready_next;
+		else
+			set->ready_head = dev->ready_next;
+		if (set->ready_tail == dev)
+			set->ready_tail = prev;
+		dev->set_ready = 0;
+	}
+	pthread_mutex_unlock(&set->mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_wait_set(hid_device_set *set, hid_device **ready, size_t max_ready, int milliseconds)
 {
-	return NULL;
+	struct timespec ts;
+	size_t n = 0;
+	int timed_out = 0;
+
+	if (max_ready == 0)
+		return 0;
+
+	if (milliseconds > 0)
+		get_abs_timeout(milliseconds, &ts);
+
+	do {
+		size_t i, j;
+		int res = 0;
+
+		pthread_mutex_lock(&set->mutex);
+		pthread_cleanup_push(&cleanup_set_mutex, set);
+
+		while (!set->ready_head && milliseconds != 0 && res == 0) {
+			if (milliseconds < 0)
+				res = pthread_cond_wait(&set->condition, &set->mutex);
+			else
+				res = pthread_cond_timedwait(&set->condition, &set->mutex, &ts);
+		}
+
+		/* Take the ready devices off the list. The list only holds
+		   ready devices, so this doesn't depend on the size of the
+		   set. */
+		while (set->ready_head && n < max_ready) {
+			hid_device *dev = set->ready_head;
+			set->ready_head = dev->ready_next;
+			if (!set->ready_head)
+				set->ready_tail = NULL;
+			dev->set_ready = 0;
+			ready[n++] = dev;
+		}
+
+		pthread_mutex_unlock(&set->mutex);
+		pthread_cleanup_pop(0);
+
+		if (res == ETIMEDOUT)
+			timed_out = 1;
+		else if (res != 0)
+			return -1;
+
+		/* Another thread may have read the reports after the device
+		   was put on the list. Only return devices which are still
+		   ready. */
+		for (i = j = 0; i < n; i++) {
+			hid_device *dev = ready[i];
+			int still_ready;
+
+			pthread_mutex_lock(&dev->mutex);
+			still_ready = dev->num_input_reports || dev->shutdown_thread;
+			pthread_mutex_unlock(&dev->mutex);
+
+			if (still_ready)
+				ready[j++] = dev;
+		}
+		n = j;
+	} while (n == 0 && milliseconds != 0 && !timed_out);
+
+	return n;
 }
 
 
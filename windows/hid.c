@@ -873,6 +873,199 @@ HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 }
 
 
+/* The rest of the API is only implemented on Linux. Here it fails
+   cleanly, so that portable programs still link. */
+
+int HID_API_EXPORT HID_API_CALL hid_init_ex(unsigned int flags)
+{
+	/* None of the flags apply here. */
+	return hid_init();
+}
+
+hid_enumeration_filter HID_API_EXPORT * HID_API_CALL hid_enumeration_filter_new(void)
+{
+	return NULL;
+}
+
+void HID_API_EXPORT HID_API_CALL hid_enumeration_filter_free(hid_enumeration_filter *filter)
+{
+}
+
+int HID_API_EXPORT HID_API_CALL hid_enumeration_filter_add_id(hid_enumeration_filter *filter, unsigned short vendor_id, unsigned short product_id)
+{
+	return -1;
+}
+
+void HID_API_EXPORT HID_API_CALL hid_enumeration_filter_set_bus_type(hid_enumeration_filter *filter, enum hid_bus_type bus_type)
+{
+}
+
+void HID_API_EXPORT HID_API_CALL hid_enumeration_filter_set_interface(hid_enumeration_filter *filter, int interface_number)
+{
+}
+
+void HID_API_EXPORT HID_API_CALL hid_enumeration_filter_set_usage(hid_enumeration_filter *filter, unsigned short usage_page, unsigned short usage)
+{
+}
+
+int HID_API_EXPORT HID_API_CALL hid_enumeration_filter_set_serial_number(hid_enumeration_filter *filter, const wchar_t *serial_number)
+{
+	return -1;
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_filtered(const hid_enumeration_filter *filter)
+{
+	return NULL;
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_flat(const hid_enumeration_filter *filter, size_t *num_devices)
+{
+	return NULL;
+}
+
+void  HID_API_EXPORT HID_API_CALL hid_free_flat_enumeration(struct hid_device_info *devs)
+{
+}
+
+hid_enumeration HID_API_EXPORT * HID_API_CALL hid_enumerate_begin(const hid_enumeration_filter *filter)
+{
+	return NULL;
+}
+
+const struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_next(hid_enumeration *enumeration)
+{
+	return NULL;
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_enumerate_get_string(hid_enumeration *enumeration, enum hid_string_type type)
+{
+	return NULL;
+}
+
+void HID_API_EXPORT HID_API_CALL hid_enumerate_end(hid_enumeration *enumeration)
+{
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_string(struct hid_device_info *info, enum hid_string_type type)
+{
+	/* hid_enumerate() always reads the strings here. */
+	switch (type) {
+	case HID_STRING_MANUFACTURER:
+		return info->manufacturer_string;
+	case HID_STRING_PRODUCT:
+		return info->product_string;
+	case HID_STRING_SERIAL_NUMBER:
+		return info->serial_number;
+	}
+	return NULL;
+}
+
+void HID_API_EXPORT HID_API_CALL hid_open_options_init(struct hid_open_options *options, size_t size)
+{
+	/* The defaults are all 0. */
+	memset(options, 0, size);
+	if (size >= sizeof(options->size))
+		options->size = size;
+}
+
+HID_API_EXPORT hid_device * HID_API_CALL hid_open_path_ex(const char *path, const struct hid_open_options *options)
+{
+	return NULL;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_read_ex(hid_device *device, unsigned char *data, size_t length, struct hid_report_info *info, int milliseconds)
+{
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_read_many(hid_device *device, unsigned char **data, size_t *lengths, size_t max_reports, int milliseconds)
+{
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_read_borrow(hid_device *device, struct hid_report_lease *lease, int milliseconds)
+{
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_read_release(hid_device *device, struct hid_report_lease *lease)
+{
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_queue_stats(hid_device *device, struct hid_queue_stats *stats)
+{
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_pollable_fd(hid_device *device)
+{
+	return -1;
+}
+
+HID_API_EXPORT hid_device_set * HID_API_CALL hid_device_set_new(void)
+{
+	return NULL;
+}
+
+void HID_API_EXPORT HID_API_CALL hid_device_set_free(hid_device_set *set)
+{
+}
+
+int HID_API_EXPORT HID_API_CALL hid_device_set_add(hid_device_set *set, hid_device *device)
+{
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_device_set_remove(hid_device *device)
+{
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_wait_set(hid_device_set *set, hid_device **ready, size_t max_ready, int milliseconds)
+{
+	return -1;
+}
+
+HID_API_EXPORT hid_uring * HID_API_CALL hid_uring_new(unsigned int queue_depth)
+{
+	return NULL;
+}
+
+void HID_API_EXPORT HID_API_CALL hid_uring_free(hid_uring *ring)
+{
+}
+
+int HID_API_EXPORT HID_API_CALL hid_uring_add_device(hid_uring *ring, hid_device *device)
+{
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_uring_remove_device(hid_device *device)
+{
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_uring_write(hid_device *device, const unsigned char *data, size_t length, void *user_data)
+{
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_uring_send_feature_report(hid_device *device, const unsigned char *data, size_t length, void *user_data)
+{
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_uring_get_feature_report(hid_device *device, unsigned char *data, size_t length, void *user_data)
+{
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_uring_wait(hid_uring *ring, struct hid_uring_completion *completions, size_t max_completions, int milliseconds)
+{
+	return -1;
+}
+
 /*#define PICPGM*/
 /*#define S11*/
 #define P32